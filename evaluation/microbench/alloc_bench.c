@@ -0,0 +1,111 @@
+/*
+ * Measures the throughput of the object allocator of Libnvmmio.
+ * Each thread repeatedly allocates a batch of index entries (each with
+ * a log block) and frees them again, as the write path and the
+ * checkpoint threads do.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "debug.h"
+
+#define DEFAULT_OPS (1UL << 20)
+#define BATCH (64)
+
+static unsigned long nr_ops = DEFAULT_OPS;
+static log_size_t log_size = LOG_4K;
+static pthread_barrier_t barrier;
+
+static void *bench_thread_func(void *parm) {
+  idx_entry_t *entries[BATCH];
+  unsigned long i;
+  int j;
+
+  (void)parm;
+  pthread_barrier_wait(&barrier);
+
+  for (i = 0; i < nr_ops; i += BATCH) {
+    for (j = 0; j < BATCH; j++) {
+      entries[j] = alloc_idx_entry(log_size, true);
+    }
+    for (j = 0; j < BATCH; j++) {
+      free_idx_entry(entries[j], log_size);
+    }
+  }
+  return NULL;
+}
+
+static double run(int nr_threads) {
+  pthread_t *threads;
+  struct timespec start, end;
+  double elapsed;
+  int i, s;
+
+  threads = (pthread_t *)malloc(nr_threads * sizeof(pthread_t));
+  if (threads == NULL) {
+    HANDLE_ERROR("malloc");
+  }
+
+  s = pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+  if (s != 0) {
+    HANDLE_ERROR("pthread_barrier_init");
+  }
+
+  for (i = 0; i < nr_threads; i++) {
+    s = pthread_create(&threads[i], NULL, bench_thread_func, NULL);
+    if (s != 0) {
+      HANDLE_ERROR("pthread_create");
+    }
+  }
+
+  pthread_barrier_wait(&barrier);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < nr_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pthread_barrier_destroy(&barrier);
+  free(threads);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return (nr_ops * nr_threads) / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  int i, nr_threads;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <threads>... [-n ops] [-s log_size]\n",
+            argv[0]);
+    return 1;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      if (argv[i][1] == 'n') {
+        nr_ops = strtoul(argv[++i], NULL, 10);
+      } else if (argv[i][1] == 's') {
+        log_size = (log_size_t)atoi(argv[++i]);
+      }
+    }
+  }
+
+  start_allocator();
+
+  printf("%8s %16s\n", "threads", "alloc+free Mops");
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') {
+      i++;
+      continue;
+    }
+    nr_threads = atoi(argv[i]);
+    printf("%8d %16.2f\n", nr_threads, run(nr_threads));
+  }
+  return 0;
+}
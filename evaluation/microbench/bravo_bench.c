@@ -0,0 +1,171 @@
+/*
+ * Measures the BRAVO reader-writer lock of the mmios against a plain
+ * pthread_rwlock_t. Each thread takes the lock for reading in a loop,
+ * and for writing once every given number of operations. Writers
+ * update two counters that readers check for equality, so a reader
+ * that overlaps a writer is caught.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bravo.h"
+#include "debug.h"
+
+#define DEFAULT_OPS (1UL << 22)
+#define DEFAULT_WRITE_PERIOD (0) /* 0 means read-only */
+
+typedef struct bench_lock_struct {
+  bravo_rwlock_t bravo;
+  pthread_rwlock_t rwlock;
+  volatile unsigned long a;
+  volatile unsigned long b;
+} bench_lock_t;
+
+static unsigned long nr_ops = DEFAULT_OPS;
+static unsigned long write_period = DEFAULT_WRITE_PERIOD;
+static bench_lock_t lock;
+static pthread_barrier_t barrier;
+static bool use_bravo;
+static unsigned long broken;
+
+static inline void read_lock(void) {
+  if (use_bravo) {
+    bravo_read_lock(&lock.bravo);
+  } else {
+    pthread_rwlock_rdlock(&lock.rwlock);
+  }
+}
+
+static inline void read_unlock(void) {
+  if (use_bravo) {
+    bravo_read_unlock(&lock.bravo);
+  } else {
+    pthread_rwlock_unlock(&lock.rwlock);
+  }
+}
+
+static inline void write_lock(void) {
+  if (use_bravo) {
+    bravo_write_lock(&lock.bravo);
+  } else {
+    pthread_rwlock_wrlock(&lock.rwlock);
+  }
+}
+
+static inline void write_unlock(void) {
+  if (use_bravo) {
+    bravo_write_unlock(&lock.bravo);
+  } else {
+    pthread_rwlock_unlock(&lock.rwlock);
+  }
+}
+
+static void *bench_thread_func(void *parm) {
+  unsigned long i, bad = 0;
+
+  (void)parm;
+  pthread_barrier_wait(&barrier);
+
+  for (i = 1; i <= nr_ops; i++) {
+    if (write_period && i % write_period == 0) {
+      write_lock();
+      lock.a++;
+      lock.b++;
+      write_unlock();
+    } else {
+      read_lock();
+      if (lock.a != lock.b) {
+        bad++;
+      }
+      read_unlock();
+    }
+  }
+
+  if (bad) {
+    __sync_fetch_and_add(&broken, bad);
+  }
+  return NULL;
+}
+
+static double run(int nr_threads, bool bravo) {
+  pthread_t *threads;
+  struct timespec start, end;
+  long i;
+  int s;
+
+  use_bravo = bravo;
+
+  threads = (pthread_t *)malloc(nr_threads * sizeof(pthread_t));
+  if (threads == NULL) {
+    HANDLE_ERROR("malloc");
+  }
+
+  s = pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+  if (s != 0) {
+    HANDLE_ERROR("pthread_barrier_init");
+  }
+
+  for (i = 0; i < nr_threads; i++) {
+    s = pthread_create(&threads[i], NULL, bench_thread_func, NULL);
+    if (s != 0) {
+      HANDLE_ERROR("pthread_create");
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_barrier_wait(&barrier);
+
+  for (i = 0; i < nr_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pthread_barrier_destroy(&barrier);
+  free(threads);
+
+  return (nr_ops * nr_threads) /
+         ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) /
+         1e6;
+}
+
+int main(int argc, char *argv[]) {
+  double bravo, rwlock;
+  int i, nr_threads;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <threads>... [-n ops] [-w write period]\n",
+            argv[0]);
+    return 1;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      if (argv[i][1] == 'n') {
+        nr_ops = strtoul(argv[++i], NULL, 10);
+      } else if (argv[i][1] == 'w') {
+        write_period = strtoul(argv[++i], NULL, 10);
+      }
+    }
+  }
+
+  bravo_rwlock_init(&lock.bravo);
+  pthread_rwlock_init(&lock.rwlock, NULL);
+
+  printf("%8s %12s %12s %8s\n", "threads", "bravo Mops", "rwlock Mops",
+         "check");
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') {
+      i++;
+      continue;
+    }
+    nr_threads = atoi(argv[i]);
+    bravo = run(nr_threads, true);
+    rwlock = run(nr_threads, false);
+    printf("%8d %12.2f %12.2f %8s\n", nr_threads, bravo, rwlock,
+           broken ? "BROKEN" : "ok");
+  }
+  return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Measures the memory taken by the tables of the radix tree, and the
+ * time to look up a log entry, for writes of a few blocks per 2MB region
+ * up to writes that fill their regions. Each pattern logs the same
+ * number of 4KB blocks in a fresh tree, with the given number of blocks
+ * in each region, and then looks the blocks up in random order.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "debug.h"
+#include "radixlog.h"
+
+#define DEFAULT_BLOCKS (1UL << 15)
+#define DEFAULT_LOOKUPS (1UL << 22)
+
+static unsigned long nr_blocks = DEFAULT_BLOCKS;
+static unsigned long nr_lookups = DEFAULT_LOOKUPS;
+static radix_root_t root; /* its generation keeps the cached tables apart */
+
+typedef struct table_count_struct {
+  unsigned long upper; /* LGD, LUD and LMD tables */
+  unsigned long leaves;
+  unsigned long sparse;
+  unsigned long full; /* full leaves and overflow tables */
+} table_count_t;
+
+static void count_tables(log_table_t *table, table_count_t *count) {
+  unsigned long i;
+
+  switch (table->type) {
+    case SPARSE_TABLE:
+      count->leaves++;
+      count->sparse++;
+      if (table->sparse.overflow != NULL) {
+        count->full++;
+      }
+      break;
+
+    case TABLE:
+      count->leaves++;
+      count->full++;
+      break;
+
+    default:
+      count->upper++;
+      for (i = 0; i < PTRS_PER_TABLE; i++) {
+        if (table->entries[i] != NULL) {
+          count_tables(table->entries[i], count);
+        }
+      }
+      break;
+  }
+}
+
+static void run(unsigned long blocks_per_region) {
+  table_count_t count = {0};
+  SLIST_HEAD(entries_head);
+  struct timespec start, end;
+  unsigned long *offsets, nr_regions, i, j, tmp, missing = 0;
+  unsigned int seed = 1;
+  log_size_t log_size;
+  double elapsed, leaf_kb, full_kb;
+
+  nr_regions = nr_blocks / blocks_per_region;
+
+  offsets = (unsigned long *)malloc(nr_blocks * sizeof(unsigned long));
+  if (offsets == NULL) {
+    HANDLE_ERROR("malloc");
+  }
+
+  /* The blocks of a region are spread over the whole region. */
+  for (i = 0; i < nr_blocks; i++) {
+    offsets[i] = ((i / blocks_per_region) << LMD_SHIFT) +
+                 (i % blocks_per_region) *
+                     (PTRS_PER_TABLE / blocks_per_region) * PAGE_SIZE;
+  }
+
+  init_radixlog(&root, nr_regions << LMD_SHIFT);
+  for (i = 0; i < nr_blocks; i++) {
+    wrlock_log_range(&root, 0, offsets[i], PAGE_SIZE, &entries_head, true);
+    wrunlock_log_range(&entries_head);
+    entries_head.next = NULL;
+  }
+  count_tables(root.lgd, &count);
+
+  for (i = nr_blocks - 1; i > 0; i--) {
+    j = rand_r(&seed) % (i + 1);
+    tmp = offsets[i];
+    offsets[i] = offsets[j];
+    offsets[j] = tmp;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < nr_lookups; i++) {
+    if (find_log_entry(&root, offsets[i % nr_blocks], &log_size) == NULL) {
+      missing++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(offsets);
+  release_radixlog(&root);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  leaf_kb = (count.sparse * SPARSE_TABLE_SIZE +
+             count.full * sizeof(log_table_t)) / 1024.0;
+  full_kb = count.leaves * sizeof(log_table_t) / 1024.0;
+
+  printf("%8lu %8lu %8lu %8lu %12.1f %12.1f %10.1f %6s\n", blocks_per_region,
+         count.leaves, count.sparse, count.full, leaf_kb, full_kb,
+         elapsed * 1e9 / nr_lookups, missing ? "BROKEN" : "ok");
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long blocks_per_region;
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: %s <blocks per region>... [-b blocks] [-n lookups]\n",
+            argv[0]);
+    return 1;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      if (argv[i][1] == 'b') {
+        nr_blocks = strtoul(argv[++i], NULL, 10);
+      } else if (argv[i][1] == 'n') {
+        nr_lookups = strtoul(argv[++i], NULL, 10);
+      }
+    }
+  }
+
+  start_allocator();
+
+  printf("%8s %8s %8s %8s %12s %12s %10s %6s\n", "blocks", "leaves", "sparse",
+         "full", "leaf KB", "all-full KB", "ns/find", "check");
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') {
+      i++;
+      continue;
+    }
+    blocks_per_region = strtoul(argv[i], NULL, 10);
+    if (blocks_per_region == 0 || blocks_per_region > PTRS_PER_TABLE ||
+        nr_blocks % blocks_per_region != 0) {
+      fprintf(stderr, "the blocks per region must divide %lu, up to %lu\n",
+              nr_blocks, PTRS_PER_TABLE);
+      return 1;
+    }
+    run(blocks_per_region);
+  }
+  return 0;
+}
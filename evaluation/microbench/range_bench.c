@@ -0,0 +1,167 @@
+/*
+ * Measures the range locks of the index entries under contention.
+ * Each thread repeatedly write-locks a range of 4KB blocks at a random
+ * offset of a small file, as overlapping writes do, bumps a counter in
+ * every locked entry and unlocks the range. The counters are checked
+ * at the end, and the CPU time shows how much of it went into waiting.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "debug.h"
+#include "radixlog.h"
+
+#define DEFAULT_OPS (1UL << 18)
+#define DEFAULT_RANGE_BLOCKS (16)
+#define DEFAULT_FILE_BLOCKS (1024) /* two leaf tables */
+
+static unsigned long nr_ops = DEFAULT_OPS;
+static unsigned long range_blocks = DEFAULT_RANGE_BLOCKS;
+static unsigned long file_blocks = DEFAULT_FILE_BLOCKS;
+static radix_root_t root;
+static pthread_barrier_t barrier;
+
+static void *bench_thread_func(void *parm) {
+  idx_entry_t *entry;
+  unsigned long i, offset;
+  unsigned int seed = (unsigned int)(unsigned long)parm;
+  SLIST_HEAD(entries_head);
+
+  pthread_barrier_wait(&barrier);
+
+  for (i = 0; i < nr_ops; i++) {
+    offset = (rand_r(&seed) % (file_blocks - range_blocks + 1)) * PAGE_SIZE;
+    entries_head.next = NULL;
+
+    wrlock_log_range(&root, 0, offset, range_blocks * PAGE_SIZE,
+                     &entries_head, true);
+    SLIST_FOR_EACH_ENTRY(entry, &entries_head, list) { entry->dst++; }
+    wrunlock_log_range(&entries_head);
+  }
+  return NULL;
+}
+
+static double get_cpu_time(void) {
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static unsigned long sum_counters(void) {
+  idx_entry_t *entry;
+  log_size_t log_size;
+  unsigned long b, sum = 0;
+
+  for (b = 0; b < file_blocks; b++) {
+    entry = find_log_entry(&root, b * PAGE_SIZE, &log_size);
+    if (entry != NULL) {
+      sum += entry->dst;
+      entry->dst = 0;
+    }
+  }
+  return sum;
+}
+
+static void run(int nr_threads) {
+  pthread_t *threads;
+  struct timespec start, end;
+  double elapsed, cpu;
+  unsigned long sum;
+  long i;
+  int s;
+
+  threads = (pthread_t *)malloc(nr_threads * sizeof(pthread_t));
+  if (threads == NULL) {
+    HANDLE_ERROR("malloc");
+  }
+
+  s = pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+  if (s != 0) {
+    HANDLE_ERROR("pthread_barrier_init");
+  }
+
+  for (i = 0; i < nr_threads; i++) {
+    s = pthread_create(&threads[i], NULL, bench_thread_func, (void *)(i + 1));
+    if (s != 0) {
+      HANDLE_ERROR("pthread_create");
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cpu = get_cpu_time();
+  pthread_barrier_wait(&barrier);
+
+  for (i = 0; i < nr_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  cpu = get_cpu_time() - cpu;
+  pthread_barrier_destroy(&barrier);
+  free(threads);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  sum = sum_counters();
+
+  printf("%8d %14.3f %10.2f %8s\n", nr_threads,
+         (nr_ops * nr_threads) / elapsed / 1e6, cpu / elapsed,
+         sum == nr_ops * nr_threads * range_blocks ? "ok" : "BROKEN");
+}
+
+int main(int argc, char *argv[]) {
+  SLIST_HEAD(entries_head);
+  unsigned long offset;
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <threads>... [-n ops] [-r range] [-f file]\n",
+            argv[0]);
+    return 1;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      if (argv[i][1] == 'n') {
+        nr_ops = strtoul(argv[++i], NULL, 10);
+      } else if (argv[i][1] == 'r') {
+        range_blocks = strtoul(argv[++i], NULL, 10);
+      } else if (argv[i][1] == 'f') {
+        file_blocks = strtoul(argv[++i], NULL, 10);
+      }
+    }
+  }
+
+  if (range_blocks == 0 || range_blocks > file_blocks) {
+    fprintf(stderr, "the range must fit in the file\n");
+    return 1;
+  }
+
+  start_allocator();
+  init_radixlog(&root, file_blocks * PAGE_SIZE);
+
+  /* Fix 4KB blocks in every leaf table before the ranges come. */
+  for (offset = 0; offset < file_blocks * PAGE_SIZE;
+       offset += 1UL << LMD_SHIFT) {
+    wrlock_log_range(&root, 0, offset, PAGE_SIZE, &entries_head, true);
+    wrunlock_log_range(&entries_head);
+    entries_head.next = NULL;
+  }
+
+  printf("%8s %14s %10s %8s\n", "threads", "Mranges/s", "cpus busy",
+         "check");
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') {
+      i++;
+      continue;
+    }
+    run(atoi(argv[i]));
+  }
+  return 0;
+}
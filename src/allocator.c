@@ -2,10 +2,13 @@
 
 #include <dirent.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "debug.h"
@@ -14,37 +17,106 @@
 #include "mmio.h"
 #include "radixlog.h"
 #include "slist.h"
+#include "autocommit.h"
 #include "bravo.h"
-
-#define DIR_PATH "%s/.libnvmmio-%lu"
+#include "checkpoint.h"
+#include "env.h"
+#include "magazine.h"
+#include "numa.h"
+#include "recovery.h"
+#include "tx.h"
 
 extern struct fops_struct posix;
-static char logdir_path[128];
+static char pmem_paths[MAX_NUMA_NODES][PATH_MAX];
+static int nr_numa_nodes = 1;
 static unsigned long libnvmmio_pid;
+static void *mmio_base = NULL;
+static mmio_record_t *mmio_records = NULL;
+static tx_record_t *tx_records = NULL;
+static unsigned long tx_record_map; /* a bit per record in use */
+
+/*
+ * Each log pool reserves address space for its ceiling, and maps
+ * LOG_SEGMENT_SIZE log files into it as it grows. Since the segments
+ * of a pool are contiguous in memory, the offset of a log from
+ * the base of its pool stays valid however the pool grows or shrinks.
+ */
+typedef enum log_segment_state_enum {
+  SEGMENT_FREE,
+  SEGMENT_ACTIVE,
+  SEGMENT_RETIRING,
+} log_segment_state_t;
+
+typedef struct log_segment_struct {
+  log_segment_state_t state;
+  unsigned long carved;    /* logs put on the free lists so far */
+  unsigned long used;      /* logs handed out */
+  unsigned long reclaimed; /* free logs taken off the lists while retiring */
+} log_segment_t;
+
+typedef struct log_pool_struct {
+  log_size_t log_size;
+  int node;
+  void *base;
+  unsigned long nr_logs;  /* logs per segment */
+  unsigned long uncarved; /* logs of active segments not carved yet */
+  int nr_active;
+  int min_segments;
+  int max_segments;
+  log_segment_t *segments;
+  flist_t *global;
+  depot_t *depot;
+} log_pool_t;
 
-static flist_t *global_log_list[NR_LOG_SIZES] = {
-    NULL,
-};
-static __thread flist_t *local_log_provider[NR_LOG_SIZES] = {
-    NULL,
-};
-static __thread flist_t *local_log_collector[NR_LOG_SIZES] = {
-    NULL,
-};
+/*
+ * The other pools are carved from preallocated arenas with a bump
+ * pointer, a batch at a time, when their free lists run low.
+ */
+typedef struct arena_struct {
+  void *base;
+  void *next;
+  void *end;
+  size_t obj_size;
+  void (*init_obj)(void *obj);
+} arena_t;
 
-static flist_t *global_idx_list = NULL;
-static __thread flist_t *local_idx_provider = NULL;
-static __thread flist_t *local_idx_collector = NULL;
+/*
+ * Each NUMA node has a log directory under its own pmem path, holding
+ * the log pools and the index pool of the node. The mmio pool lives
+ * on node 0, whose log directory recovery looks for.
+ */
+typedef struct numa_pool_struct {
+  char logdir_path[PATH_MAX];
+  log_pool_t log_pools[NR_LOG_SIZES];
+  arena_t idx_arena;
+  idx_record_t *idx_records; /* the index pool, parallel to idx_arena */
+  flist_t *global_idx_list;
+  depot_t *idx_depot;
+  struct slist_head free_chunks[NR_LOG_SIZES]; /* by global_idx_list->mutex */
+  unsigned long free_chunk_cnt;                /* entries in free_chunks */
+  unsigned long remote_allocs;
+  unsigned long reclaimed_logs; /* popped from the depots while retiring */
+} numa_pool_t;
+
+static numa_pool_t numa_pools[MAX_NUMA_NODES];
+
+static arena_t mmio_arena;
+static arena_t table_arena;
+static arena_t sparse_table_arena;
+
+static pthread_once_t allocator_once = PTHREAD_ONCE_INIT;
+static bool allocator_started = false;
 
 static flist_t *global_mmio_list = NULL;
-static __thread flist_t *local_mmio_provider = NULL;
-static __thread flist_t *local_mmio_collector = NULL;
+static depot_t *mmio_depot = NULL;
 
 static flist_t *global_table_list = NULL;
-static __thread flist_t *local_table_provider = NULL;
-static __thread flist_t *local_table_collector = NULL;
+static depot_t *table_depot = NULL;
+
+static flist_t *global_sparse_table_list = NULL;
+static depot_t *sparse_table_depot = NULL;
 
-flist_t *alloc_flist(unsigned long skip_unit) {
+flist_t *alloc_flist(unsigned long batch) {
   flist_t *new_list;
   int s;
 
@@ -55,121 +127,194 @@ flist_t *alloc_flist(unsigned long skip_unit) {
   }
 
   new_list->list_head.next = NULL;
-  new_list->skip_head.next = NULL;
   new_list->list_cnt = 0;
-  new_list->skip_cnt = 0;
-  new_list->skip_unit = skip_unit;
+  new_list->batch = batch;
+  new_list->total_cnt = 0;
+  new_list->nodes = NULL;
+  new_list->base = NULL;
+  new_list->obj_size = 0;
+  new_list->grow = NULL;
+  new_list->grow_arg = NULL;
+  new_list->waiters = 0;
 
   s = pthread_mutex_init(&new_list->mutex, NULL);
   if (__glibc_unlikely(s != 0)) {
     HANDLE_ERROR("pthread_mutex_init");
   }
 
+  s = pthread_cond_init(&new_list->freed, NULL);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("pthread_cond_init");
+  }
+
   return new_list;
 }
 
-inline fnode_t *get_fnode(void) {
-  fnode_t *fnode;
-  fnode = (fnode_t *)malloc(sizeof(fnode));
-  if (__glibc_unlikely(fnode == NULL)) {
-    HANDLE_ERROR("malloc");
+/*
+ * The side array is reserved for all the objects the pool may ever hold,
+ * and its pages are only backed once they are touched.
+ */
+void init_fnodes(flist_t *global, void *base, size_t obj_size,
+                 unsigned long count) {
+  void *nodes;
+
+  nodes = mmap(NULL, count * sizeof(fnode_t), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (__glibc_unlikely(nodes == MAP_FAILED)) {
+    HANDLE_ERROR("mmap");
   }
-  return fnode;
-}
 
-inline void put_fnode(fnode_t *fnode) { free(fnode); }
+  global->nodes = (fnode_t *)nodes;
+  global->base = base;
+  global->obj_size = obj_size;
+}
 
 /*
  * Before calling put_global(), global->mutex lock must be acquired.
  */
 void put_global(fnode_t *node, flist_t *global) {
-  if (__glibc_unlikely(global->list_cnt % global->skip_unit == 0)) {
-    slist_push(&node->skip, &global->skip_head);
-    global->skip_cnt++;
-  }
   slist_push(&node->list, &global->list_head);
   global->list_cnt++;
+
+  if (__glibc_unlikely(global->waiters > 0)) {
+    pthread_cond_broadcast(&global->freed);
+  }
 }
 
-void fill_local_provider(flist_t *local_provider, flist_t *global) {
+/*
+ * Take up to n objects from the global list. If the pool is exhausted,
+ * wait until some are freed, or return 0 unless wait is set. Writers
+ * never wait here, neither for log blocks and entries nor for tables,
+ * since they may hold back the commit that would free the objects; they
+ * back off in mmio_writev() instead.
+ */
+unsigned long get_global(flist_t *global, void **objs, unsigned long n,
+                         bool wait) {
   fnode_t *node;
+  unsigned long i;
 
   MUTEX_LOCK(&global->mutex);
 
-  if (__glibc_unlikely(slist_empty(&global->skip_head))) {
-    HANDLE_ERROR("global->skip_list is empty");
+  /*
+   * Carve more objects before the pool runs dry.
+   */
+  if (global->grow && global->list_cnt < global->batch * POOL_GROW_BATCHES) {
+    global->grow(global);
   }
 
-  node = SLIST_ENTRY(global->skip_head.next, fnode_t, skip);
-  slist_cut_splice(&global->list_head, &node->list, &local_provider->list_head);
-  slist_pop(&global->skip_head);
+  while (__glibc_unlikely(slist_empty(&global->list_head))) {
+    if (global->grow && global->grow(global)) {
+      continue;
+    }
 
-  MUTEX_UNLOCK(&global->mutex);
-}
+    if (!wait) {
+      MUTEX_UNLOCK(&global->mutex);
+      return 0;
+    }
 
-void put_local_collector(fnode_t *node, flist_t *collector, flist_t *global) {
-  if (__glibc_unlikely(collector->list_cnt % collector->skip_unit == 0)) {
-    if (collector->skip_cnt >= MAX_SKIP_NODES) {
-      fnode_t *skip_node;
-      unsigned long count;
+    kick_autocommit();
+    global->waiters++;
+    pthread_cond_wait(&global->freed, &global->mutex);
+    global->waiters--;
+  }
 
-      MUTEX_LOCK(&global->mutex);
+  for (i = 0; i < n && !slist_empty(&global->list_head); i++) {
+    node = SLIST_ENTRY(slist_pop(&global->list_head), fnode_t, list);
+    objs[i] = node->ptr;
+  }
+  global->list_cnt -= i;
 
-      skip_node = SLIST_ENTRY(collector->skip_head.next, fnode_t, skip);
-      slist_cut_splice(&collector->list_head, &skip_node->list,
-                       &global->list_head);
-      slist_pop(&collector->skip_head);
-      slist_push(&skip_node->skip, &global->skip_head);
+  MUTEX_UNLOCK(&global->mutex);
+  return i;
+}
 
-      count = collector->skip_unit;
-      collector->list_cnt -= count;
-      global->list_cnt += count;
-      collector->skip_cnt--;
-      global->skip_cnt++;
+void put_global_objs(flist_t *global, void **objs, unsigned long n) {
+  unsigned long i;
 
-      MUTEX_UNLOCK(&global->mutex);
-    }
-    slist_push(&node->skip, &collector->skip_head);
-    collector->skip_cnt++;
+  MUTEX_LOCK(&global->mutex);
+  for (i = 0; i < n; i++) {
+    PUSH_GLOBAL(objs[i], global);
   }
-  slist_push(&node->list, &collector->list_head);
-  collector->list_cnt++;
+  MUTEX_UNLOCK(&global->mutex);
 }
 
-static int get_env(void) {
-  char *pmem_path;
+/*
+ * PMEM_PATH may list one pmem path per NUMA node, separated by colons.
+ */
+static void get_env(void) {
+  char *env, *path, *saveptr = NULL;
+  char paths[PATH_MAX * MAX_NUMA_NODES];
   size_t len;
+  int i;
 
-  pmem_path = getenv("PMEM_PATH");
-  if (pmem_path == NULL) {
-    len = strlen(DEFAULT_PMEM_PATH) + 1;
-    pmem_path = (char *)malloc(len);
-    if (__glibc_unlikely(pmem_path == NULL)) {
-      HANDLE_ERROR("malloc");
-    }
-    strcpy(pmem_path, DEFAULT_PMEM_PATH);
+  env = getenv("PMEM_PATH");
+  if (env == NULL) {
+    env = DEFAULT_PMEM_PATH;
   }
 
-  len = strlen(pmem_path);
+  if (__glibc_unlikely(strlen(env) >= sizeof(paths))) {
+    HANDLE_ERROR("PMEM_PATH is wrong");
+  }
+  strcpy(paths, env);
+
+  nr_numa_nodes = 0;
+  for (path = strtok_r(paths, ":", &saveptr); path != NULL;
+       path = strtok_r(NULL, ":", &saveptr)) {
+    len = strlen(path);
+    if (__glibc_unlikely(len >= PATH_MAX || nr_numa_nodes >= MAX_NUMA_NODES)) {
+      HANDLE_ERROR("PMEM_PATH is wrong");
+    }
+    strcpy(pmem_paths[nr_numa_nodes], path);
+
+    if (len > 1 && path[len - 1] == '/') {
+      pmem_paths[nr_numa_nodes][len - 1] = '\0';
+    }
+    nr_numa_nodes++;
+  }
 
-  if (pmem_path[len - 1] == '/') {
-    pmem_path[len - 1] = '\0';
+  if (__glibc_unlikely(nr_numa_nodes == 0)) {
+    HANDLE_ERROR("PMEM_PATH is wrong");
   }
 
   libnvmmio_pid = getpid();
 
-  sprintf(logdir_path, DIR_PATH, pmem_path, libnvmmio_pid);
-  PRINT("logdir_path=%s", logdir_path);
-  return mkdir(logdir_path, 0700);
+  for (i = 0; i < nr_numa_nodes; i++) {
+    sprintf(numa_pools[i].logdir_path, DIR_PATH, pmem_paths[i],
+            libnvmmio_pid);
+    PRINT("node %d: logdir_path=%s", i, numa_pools[i].logdir_path);
+  }
 }
 
-static void __attribute__((destructor)) remove_logs(void) {
-  char filename[1024];
+/*
+ * The log directory stays locked while the process is alive,
+ * so that recovery can tell orphaned log directories from live ones.
+ */
+static void create_logdir(const char *logdir_path) {
+  int fd, s;
+
+  s = mkdir(logdir_path, 0700);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("mkdir(%s)", logdir_path);
+  }
+
+  fd = posix.open(logdir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (__glibc_unlikely(fd == -1)) {
+    HANDLE_ERROR("open(%s)", logdir_path);
+  }
+
+  s = flock(fd, LOCK_EX | LOCK_NB);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("flock(%s)", logdir_path);
+  }
+}
+
+void remove_logdir(const char *path) {
+  char filename[PATH_MAX + NAME_MAX + 2];
   DIR *dirptr = NULL;
   struct dirent *file = NULL;
   int s;
 
-  dirptr = opendir(logdir_path);
+  dirptr = opendir(path);
   if (__glibc_unlikely(dirptr == NULL)) {
     HANDLE_ERROR("opendir");
   }
@@ -178,7 +323,7 @@ static void __attribute__((destructor)) remove_logs(void) {
     if (strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0) {
       continue;
     }
-    sprintf(filename, "%s/%s", logdir_path, file->d_name);
+    sprintf(filename, "%s/%s", path, file->d_name);
 
     s = unlink(filename);
     if (__glibc_unlikely(s != 0)) {
@@ -187,18 +332,50 @@ static void __attribute__((destructor)) remove_logs(void) {
   }
   s = closedir(dirptr);
   if (__glibc_unlikely(s != 0)) {
-    HANDLE_ERROR("unlink");
+    HANDLE_ERROR("closedir");
   }
 
-  s = rmdir(logdir_path);
+  s = rmdir(path);
   if (__glibc_unlikely(s != 0)) {
     HANDLE_ERROR("rmdir");
   }
 
-  PRINT("finished");
+  PRINT("removed %s", path);
+}
+
+static void report_numa_stats(void) {
+  numa_stats_t stats;
+  int i;
+
+  for (i = 0; i < nr_numa_nodes; i++) {
+    get_numa_stats(i, &stats);
+    fprintf(stderr,
+            "[libnvmmio] node %d: log allocs %lu (in use %lu), "
+            "index allocs %lu (in use %lu), remote allocs %lu\n",
+            i, stats.log_allocs, stats.log_allocs - stats.log_frees,
+            stats.idx_allocs, stats.idx_allocs - stats.idx_frees,
+            stats.remote_allocs);
+  }
+}
+
+static void __attribute__((destructor)) remove_logs(void) {
+  int i;
+
+  if (!allocator_started) {
+    return;
+  }
+
+  if (get_env_ulong("NUMA_STATS", 0)) {
+    report_numa_stats();
+  }
+
+  for (i = 0; i < nr_numa_nodes; i++) {
+    remove_logdir(numa_pools[i].logdir_path);
+  }
 }
 
-static void *mmap_logfile(const char *path, size_t len) {
+static void *mmap_logfile(const char *path, size_t len, void *fixed,
+                          bool populate) {
   void *addr;
   int fd, flags, s;
 
@@ -215,40 +392,102 @@ static void *mmap_logfile(const char *path, size_t len) {
     if (__glibc_unlikely(s != 0)) {
       HANDLE_ERROR("posix_fallocate, len=%lu", len);
     }
-    flags = MAP_SHARED | MAP_POPULATE;
+    flags = populate ? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
   }
 
-  addr = mmap(0, len, PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (fixed) {
+    flags |= MAP_FIXED;
+  }
+
+  addr = mmap(fixed, len, PROT_READ | PROT_WRITE, flags, fd, 0);
   if (__glibc_unlikely(addr == MAP_FAILED)) {
     HANDLE_ERROR("mmap");
   }
 
+  if (fd != -1) {
+    posix.close(fd);
+  }
+
   PRINT("file=%s, len=%s", path, get_readable_size(len));
   return addr;
 }
 
-static void *alloc_pmem(char *name, int number, size_t size) {
-  char filename[1024];
-  sprintf(filename, "%s/%s-%d.log", logdir_path, name, number);
-  return mmap_logfile(filename, size);
+static void *alloc_pmem(int node, char *name, int number, size_t size,
+                        void *fixed, bool populate) {
+  char filename[PATH_MAX << 1];
+  sprintf(filename, LOGFILE_PATH, numa_pools[node].logdir_path, name, number);
+  return mmap_logfile(filename, size, fixed, populate);
 }
 
-static void create_global_list(void *addr, size_t size, unsigned long count,
-                               flist_t *global, void (*init_obj)(void *obj)) {
+static void free_pmem(int node, char *name, int number, void *addr,
+                      size_t size) {
+  char filename[PATH_MAX << 1];
+  void *s;
+
+  /*
+   * Keep the address range reserved for the next segment. It stays
+   * readable, since an optimistic reader may still be copying a log
+   * freed from it; the reader sees zeros, and then fails to validate.
+   */
+  s = mmap(addr, size, PROT_READ,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  if (__glibc_unlikely(s == MAP_FAILED)) {
+    HANDLE_ERROR("mmap");
+  }
+
+  sprintf(filename, LOGFILE_PATH, numa_pools[node].logdir_path, name, number);
+  if (__glibc_unlikely(unlink(filename) != 0)) {
+    HANDLE_ERROR("unlink(%s)", filename);
+  }
+  PRINT("file=%s, len=%s", filename, get_readable_size(size));
+}
+
+static void init_arena(arena_t *arena, void *addr, size_t obj_size,
+                       unsigned long count, void (*init_obj)(void *obj)) {
+  arena->base = addr;
+  arena->next = addr;
+  arena->end = addr + (obj_size * count);
+  arena->obj_size = obj_size;
+  arena->init_obj = init_obj;
+}
+
+static inline unsigned long arena_remaining(arena_t *arena) {
+  return (arena->end - arena->next) / arena->obj_size;
+}
+
+/*
+ * Before calling carve_arena(), global->mutex must be acquired.
+ */
+static bool carve_arena(flist_t *global) {
+  arena_t *arena;
   void *obj;
   unsigned long i;
 
-  MUTEX_LOCK(&global->mutex);
+  arena = (arena_t *)global->grow_arg;
+
+  for (i = 0; i < global->batch && arena->next < arena->end; i++) {
+    obj = arena->next;
+    arena->next += arena->obj_size;
 
-  for (i = 0; i < count; i++) {
-    obj = addr + (i * size);
-    if (init_obj) {
-      init_obj(obj);
+    if (arena->init_obj) {
+      arena->init_obj(obj);
     }
     PUSH_GLOBAL(obj, global);
   }
+  global->total_cnt += i;
 
-  MUTEX_UNLOCK(&global->mutex);
+  return i > 0;
+}
+
+static flist_t *create_arena_list(arena_t *arena, unsigned long batch) {
+  flist_t *global;
+
+  global = alloc_flist(batch);
+  init_fnodes(global, arena->base, arena->obj_size,
+              (arena->end - arena->base) / arena->obj_size);
+  global->grow = carve_arena;
+  global->grow_arg = arena;
+  return global;
 }
 
 static void init_table(void *obj) { memset(obj, 0, sizeof(log_table_t)); }
@@ -268,78 +507,352 @@ static void create_global_table_list(void) {
   }
   PRINT("pre-allocated memory: %s", get_readable_size(mem_size));
 
-  global_table_list = alloc_flist(NR_NODE_FILL);
-  create_global_list(addr, table_size, count, global_table_list, init_table);
+  init_arena(&table_arena, addr, table_size, count, init_table);
+  global_table_list = create_arena_list(&table_arena, NR_NODE_FILL);
+  table_depot = create_depot(global_table_list, count);
 
   PRINT("the number of nodes: %lu, log_table_t size: %lu", count, table_size);
 }
 
-static void create_global_log_list(void) {
+static void init_sparse_table(void *obj) { memset(obj, 0, SPARSE_TABLE_SIZE); }
+
+static void create_global_sparse_table_list(void) {
+  void *addr;
+  size_t mem_size;
+  unsigned long count;
+
+  count = NR_ALLOC_SPARSE_TABLES - (NR_ALLOC_SPARSE_TABLES % NR_NODE_FILL);
+  mem_size = SPARSE_TABLE_SIZE * count;
+
+  addr = (void *)malloc(mem_size);
+  if (__glibc_unlikely(addr == NULL)) {
+    HANDLE_ERROR("malloc");
+  }
+  PRINT("pre-allocated memory: %s", get_readable_size(mem_size));
+
+  init_arena(&sparse_table_arena, addr, SPARSE_TABLE_SIZE, count,
+             init_sparse_table);
+  global_sparse_table_list = create_arena_list(&sparse_table_arena,
+                                               NR_NODE_FILL);
+  sparse_table_depot = create_depot(global_sparse_table_list, count);
+
+  PRINT("the number of sparse nodes: %lu, size: %lu", count,
+        SPARSE_TABLE_SIZE);
+}
+
+static inline void *get_segment_addr(log_pool_t *pool, int seg) {
+  return pool->base + ((unsigned long)seg * LOG_SEGMENT_SIZE);
+}
+
+static inline log_segment_t *get_log_segment(log_pool_t *pool, void *data) {
+  return &pool->segments[(data - pool->base) / LOG_SEGMENT_SIZE];
+}
+
+static void map_log_segment(log_pool_t *pool, int seg) {
+  char name[NAME_MAX];
+
+  sprintf(name, LOG_SEGMENT_NAME, pool->log_size);
+  alloc_pmem(pool->node, name, seg, LOG_SEGMENT_SIZE,
+             get_segment_addr(pool, seg), true);
+
+  pool->segments[seg].carved = 0;
+  pool->segments[seg].used = 0;
+  pool->segments[seg].reclaimed = 0;
+  pool->segments[seg].state = SEGMENT_ACTIVE;
+  pool->nr_active++;
+  pool->uncarved += pool->nr_logs;
+}
+
+static void carve_log_segment(log_pool_t *pool, int seg, flist_t *global) {
+  log_segment_t *segment;
+  void *addr;
+  unsigned long i;
+
+  segment = &pool->segments[seg];
+  addr = get_segment_addr(pool, seg);
+
+  for (i = 0; i < global->batch && segment->carved < pool->nr_logs; i++) {
+    PUSH_GLOBAL(addr + (segment->carved++ << LOG_SHIFT(pool->log_size)),
+                global);
+  }
+  global->total_cnt += i;
+  pool->uncarved -= i;
+}
+
+static void unmap_log_segment(log_pool_t *pool, int seg) {
+  char name[NAME_MAX];
+
+  sprintf(name, LOG_SEGMENT_NAME, pool->log_size);
+  free_pmem(pool->node, name, seg, get_segment_addr(pool, seg),
+            LOG_SEGMENT_SIZE);
+  pool->segments[seg].state = SEGMENT_FREE;
+}
+
+/*
+ * Before calling grow_log_pool(), global->mutex must be acquired.
+ */
+static bool grow_log_pool(flist_t *global) {
+  log_pool_t *pool;
+  int seg;
+
+  pool = (log_pool_t *)global->grow_arg;
+
+  for (seg = 0; seg < pool->max_segments; seg++) {
+    if (pool->segments[seg].state == SEGMENT_ACTIVE &&
+        pool->segments[seg].carved < pool->nr_logs) {
+      carve_log_segment(pool, seg, global);
+      return true;
+    }
+  }
+
+  if (pool->nr_active >= pool->max_segments) {
+    return false;
+  }
+
+  for (seg = 0; seg < pool->max_segments; seg++) {
+    if (pool->segments[seg].state == SEGMENT_FREE) {
+      map_log_segment(pool, seg);
+      carve_log_segment(pool, seg, global);
+      PRINT("node: %d, log size: %lu, segments: %d", pool->node,
+            LOG_SIZE(pool->log_size), pool->nr_active);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Stop handing out the logs of an idle segment. The free logs on the
+ * global list are taken off right away, and the ones cached by threads
+ * are reclaimed when they are popped. The segment is unmapped once all
+ * of its logs have been reclaimed.
+ */
+static void retire_log_segment(log_pool_t *pool, int seg, flist_t *global) {
+  log_segment_t *segment;
+  struct slist_head *next;
+  fnode_t *node;
+
+  segment = &pool->segments[seg];
+  segment->state = SEGMENT_RETIRING;
+  pool->nr_active--;
+  pool->uncarved -= pool->nr_logs - segment->carved;
+  global->total_cnt -= segment->carved;
+
+  next = global->list_head.next;
+  global->list_head.next = NULL;
+  global->list_cnt = 0;
+
+  while (next) {
+    node = SLIST_ENTRY(next, fnode_t, list);
+    next = next->next;
+
+    if (get_log_segment(pool, node->ptr) == segment) {
+      segment->reclaimed++;
+    } else {
+      put_global(node, global);
+    }
+  }
+
+  if (segment->reclaimed == segment->carved) {
+    unmap_log_segment(pool, seg);
+  }
+  PRINT("node: %d, log size: %lu, segments: %d", pool->node,
+        LOG_SIZE(pool->log_size), pool->nr_active);
+}
+
+static void reclaim_log_data(log_pool_t *pool, log_segment_t *segment) {
+  flist_t *global;
+
+  global = pool->global;
+  __sync_fetch_and_add(&numa_pools[pool->node].reclaimed_logs, 1);
+
+  MUTEX_LOCK(&global->mutex);
+  if (++segment->reclaimed == segment->carved) {
+    unmap_log_segment(pool, segment - pool->segments);
+  }
+  MUTEX_UNLOCK(&global->mutex);
+}
+
+/*
+ * Retire the last active segment of each pool above its floor if none
+ * of its logs is in use and another segment worth of logs is free.
+ */
+void shrink_log_pools(void) {
+  log_pool_t *pool;
+  flist_t *global;
+  int node, i, seg;
+
+  for (node = 0; node < nr_numa_nodes; node++) {
+    for (i = 0; i < NR_LOG_SIZES; i++) {
+      pool = &numa_pools[node].log_pools[i];
+      global = pool->global;
+
+      if (global == NULL || pool->nr_active <= pool->min_segments) {
+        continue;
+      }
+
+      /* Free logs cached in the depot would keep the segment busy. */
+      drain_depot(pool->depot);
+
+      MUTEX_LOCK(&global->mutex);
+
+      if (pool->nr_active > pool->min_segments &&
+          global->list_cnt + pool->uncarved >= pool->nr_logs * 2) {
+        for (seg = pool->max_segments - 1; seg >= 0; seg--) {
+          if (pool->segments[seg].state == SEGMENT_ACTIVE) {
+            break;
+          }
+        }
+
+        if (seg >= 0 && pool->segments[seg].used == 0) {
+          retire_log_segment(pool, seg, global);
+        }
+      }
+
+      MUTEX_UNLOCK(&global->mutex);
+    }
+  }
+}
+
+static unsigned long get_log_pool_limit(const char *name, log_size_t log_size,
+                                        unsigned long default_value) {
+  char env[NAME_MAX];
+  unsigned long size;
+
+  default_value = get_env_ulong(name, default_value);
+
+  size = LOG_SIZE(log_size) >> 10;
+  if (size < 1024) {
+    sprintf(env, "%s_%luK", name, size);
+  } else {
+    sprintf(env, "%s_%luM", name, size >> 10);
+  }
+  return get_env_ulong(env, default_value);
+}
+
+static void create_global_log_list(int node) {
+  log_pool_t *pool;
+  flist_t *global;
+  unsigned long floor, ceiling, batch;
   void *addr;
-  size_t log_size, file_size;
-  int count;
   int i;
 
   for (i = 0; i < NR_LOG_SIZES; i++) {
-    log_size = 1UL << LOG_SHIFT(i);
-    count = LOG_FILE_SIZE >> LOG_SHIFT(i);
-    count = count - (count % NR_NODE_FILL);
-    file_size = log_size * count;
-    addr = alloc_pmem("logs", i, file_size);
+    pool = &numa_pools[node].log_pools[i];
+    floor = get_log_pool_limit("LOG_POOL_FLOOR", i, LOG_POOL_FLOOR);
+    ceiling = get_log_pool_limit("LOG_POOL_CEILING", i, LOG_POOL_CEILING);
+
+    pool->log_size = i;
+    pool->node = node;
+    pool->nr_logs = LOG_SEGMENT_SIZE >> LOG_SHIFT(i);
+    pool->uncarved = 0;
+    pool->nr_active = 0;
+    pool->min_segments = (floor + LOG_SEGMENT_SIZE - 1) / LOG_SEGMENT_SIZE;
+    pool->max_segments = (ceiling + LOG_SEGMENT_SIZE - 1) / LOG_SEGMENT_SIZE;
+    if (pool->max_segments < pool->min_segments) {
+      pool->max_segments = pool->min_segments;
+    }
+    if (pool->max_segments == 0) {
+      pool->max_segments = 1;
+    }
 
-    global_log_list[i] = alloc_flist(NR_NODE_FILL);
-    create_global_list(addr, log_size, count, global_log_list[i], NULL);
+    pool->segments =
+        (log_segment_t *)calloc(pool->max_segments, sizeof(log_segment_t));
+    if (__glibc_unlikely(pool->segments == NULL)) {
+      HANDLE_ERROR("calloc");
+    }
+
+    addr = mmap(NULL, pool->max_segments * LOG_SEGMENT_SIZE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (__glibc_unlikely(addr == MAP_FAILED)) {
+      HANDLE_ERROR("mmap");
+    }
+    pool->base = addr;
 
-    PRINT("the number of nodes: %d, log size: %lu", count, log_size);
+    batch = pool->nr_logs / LOG_SEGMENT_BATCHES;
+    if (batch == 0) {
+      batch = 1;
+    } else if (batch > NR_NODE_FILL) {
+      batch = NR_NODE_FILL;
+    }
+
+    global = alloc_flist(batch);
+    init_fnodes(global, addr, LOG_SIZE(i), pool->max_segments * pool->nr_logs);
+    global->grow = grow_log_pool;
+    global->grow_arg = pool;
+    pool->global = global;
+    pool->depot = create_depot(global, pool->max_segments * pool->nr_logs);
+
+    PRINT("node: %d, log size: %lu, segments: %d~%d", node, LOG_SIZE(i),
+          pool->min_segments, pool->max_segments);
   }
 }
 
+static inline int get_idx_node(idx_entry_t *entry) {
+  arena_t *arena;
+  int node;
+
+  for (node = 0; node < nr_numa_nodes - 1; node++) {
+    arena = &numa_pools[node].idx_arena;
+    if ((void *)entry >= arena->base && (void *)entry < arena->end) {
+      break;
+    }
+  }
+  return node;
+}
+
 static void init_idx(void *obj) {
+  numa_pool_t *numa_pool;
   idx_entry_t *entry;
-  int s;
 
   entry = (idx_entry_t *)obj;
-
-  entry->rwlockp = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
-  if (__glibc_unlikely(entry->rwlockp == NULL)) {
-    HANDLE_ERROR("malloc");
-  }
-
-  s = pthread_rwlock_init(entry->rwlockp, NULL);
-  if (__glibc_unlikely(s != 0)) {
-    HANDLE_ERROR("pthread_rwlock_init");
-  }
+  numa_pool = &numa_pools[get_idx_node(entry)];
+  entry->record = numa_pool->idx_records +
+                  (entry - (idx_entry_t *)numa_pool->idx_arena.base);
+  entry->lock.word = 0;
   entry->united = 0;
-  entry->dst = NULL;
+  entry->dst = 0;
   entry->log = NULL;
 }
 
-static void create_global_idx_list(void) {
+static void create_global_idx_list(int node) {
+  numa_pool_t *numa_pool;
   void *addr;
   size_t size;
   unsigned long count;
   int i;
 
+  numa_pool = &numa_pools[node];
+
   count = LOG_FILE_SIZE >> PAGE_SHIFT;
   for (i = 1; i < NR_LOG_SIZES; i++) {
     count += count / 2;
   }
 
-  size = count * sizeof(idx_entry_t);
-  addr = alloc_pmem("index", 0, size);
+  size = count * sizeof(idx_record_t);
+  numa_pool->idx_records = alloc_pmem(node, "index", 0, size, NULL, false);
 
-  global_idx_list = alloc_flist(NR_NODE_FILL);
-  create_global_list(addr, sizeof(idx_entry_t), count, global_idx_list,
-                     init_idx);
+  addr = malloc(count * sizeof(idx_entry_t));
+  if (__glibc_unlikely(addr == NULL)) {
+    HANDLE_ERROR("malloc");
+  }
 
-  PRINT("the number of nodes: %lu, idx_entry_t size: %lu", count,
-        sizeof(idx_entry_t));
+  init_arena(&numa_pool->idx_arena, addr, sizeof(idx_entry_t), count,
+             init_idx);
+  numa_pool->global_idx_list =
+      create_arena_list(&numa_pool->idx_arena, NR_NODE_FILL);
+  numa_pool->idx_depot = create_depot(numa_pool->global_idx_list, count);
+
+  PRINT("node: %d, the number of nodes: %lu, idx_entry_t size: %lu", node,
+        count, sizeof(idx_entry_t));
 }
 
 static void init_mmio(void *obj) {
   mmio_t *mmio;
 
   mmio = (mmio_t *)obj;
+  mmio->id = (obj - mmio_base) / sizeof(mmio_t);
+  mmio->record = &mmio_records[mmio->id];
   bravo_rwlock_init(&mmio->rwlock);
   mmio->start = NULL;
   mmio->end = NULL;
@@ -348,9 +861,21 @@ static void init_mmio(void *obj) {
   mmio->policy = DEFAULT_POLICY;
   mmio->radixlog.lgd = NULL;
   mmio->radixlog.skip = NULL;
+  mmio->radixlog.dirty = NULL;
   mmio->read = 0;
   mmio->write = 0;
   mmio->fsize = 0;
+  INIT_LIST_HEAD(&mmio->checkpoint_list);
+  INIT_LIST_HEAD(&mmio->autocommit_list);
+  mmio->checkpoint_queued = false;
+  mmio->checkpoint_running = false;
+  mmio->checkpointers = 0;
+  mmio->tx_holds = 0;
+  mmio->committing = false;
+  pthread_mutex_init(&mmio->commit_mutex, NULL);
+  pthread_cond_init(&mmio->commit_cond, NULL);
+  mmio->commit_started = 0;
+  mmio->commit_done = 0;
 }
 
 static void create_global_mmio_list(void) {
@@ -360,15 +885,58 @@ static void create_global_mmio_list(void) {
 
   mmio_size = sizeof(mmio_t);
   count = NR_MMIOS - (NR_MMIOS % NR_MMIO_FILL);
+  mem_size = sizeof(mmio_record_t) * count;
+  mmio_records = alloc_pmem(0, "mmio", 0, mem_size, NULL, false);
+
+  /* The pins of the writers of each mmio sit on their own cache lines. */
   mem_size = mmio_size * count;
-  addr = alloc_pmem("mmio", 0, mem_size);
+  addr = aligned_alloc(CACHELINE_SIZE, mem_size);
+  if (__glibc_unlikely(addr == NULL)) {
+    HANDLE_ERROR("aligned_alloc");
+  }
+  memset(addr, 0, mem_size);
+  mmio_base = addr;
 
-  global_mmio_list = alloc_flist(NR_MMIO_FILL);
-  create_global_list(addr, mmio_size, count, global_mmio_list, init_mmio);
+  init_arena(&mmio_arena, addr, mmio_size, count, init_mmio);
+  global_mmio_list = create_arena_list(&mmio_arena, NR_MMIO_FILL);
+  mmio_depot = create_depot(global_mmio_list, count);
 
   PRINT("the number of nodes: %lu, log size: %lu", count, mmio_size);
 }
 
+static void create_tx_records(void) {
+  tx_records = alloc_pmem(0, "tx", 0, NR_TX_RECORDS * sizeof(tx_record_t),
+                          NULL, false);
+}
+
+/*
+ * Transactions are few and short, so the records are taken from a
+ * bitmap. Return NULL if they are all in use.
+ */
+tx_record_t *alloc_tx_record(void) {
+  unsigned long map;
+  int i;
+
+  map = __atomic_load_n(&tx_record_map, __ATOMIC_RELAXED);
+  for (;;) {
+    if (map == ~0UL >> (BITS_PER_LONG - NR_TX_RECORDS)) {
+      return NULL;
+    }
+
+    i = __builtin_ctzl(~map);
+    if (__atomic_compare_exchange_n(&tx_record_map, &map, map | (1UL << i),
+                                    true, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      return &tx_records[i];
+    }
+  }
+}
+
+void free_tx_record(tx_record_t *record) {
+  __atomic_and_fetch(&tx_record_map, ~(1UL << (record - tx_records)),
+                     __ATOMIC_RELEASE);
+}
+
 static inline int get_prot(int flags) {
   int prot;
   /*
@@ -393,14 +961,15 @@ static inline int get_prot(int flags) {
   return prot;
 }
 
-mmio_t *get_new_mmio(int fd, int flags, unsigned long ino,
-                     unsigned long fsize) {
+mmio_t *get_new_mmio(int fd, int flags, unsigned long ino, unsigned long fsize,
+                     const char *path) {
   mmio_t *mmio = NULL;
+  mmio_record_t *record;
   void *addr;
   unsigned long len;
   int s, prot;
 
-  POP_PROVIDER(mmio, mmio_t, local_mmio_provider, global_mmio_list);
+  mmio = (mmio_t *)magazine_alloc(mmio_depot);
 
   if (fsize == 0) {
     len = DEFAULT_MMAP_SIZE;
@@ -424,7 +993,20 @@ mmio_t *get_new_mmio(int fd, int flags, unsigned long ino,
   mmio->end = addr + len;
   mmio->fsize = fsize;
   mmio->ino = ino;
-  create_checkpoint_thread(mmio);
+
+  /*
+   * Recovery finds the file of a log entry through the record of its mmio.
+   */
+  record = mmio->record;
+  record->ino = ino;
+  record->epoch = mmio->epoch;
+  record->commit_fsize[0] = fsize;
+  record->commit_fsize[1] = fsize;
+  strcpy(record->path, path);
+  FLUSH(record, offsetof(mmio_record_t, path) + strlen(path) + 1);
+  FENCE();
+
+  register_autocommit(mmio);
 
   return mmio;
 }
@@ -432,13 +1014,9 @@ mmio_t *get_new_mmio(int fd, int flags, unsigned long ino,
 void release_mmio(mmio_t *mmio, int flags, int fd) {
   int s;
 
-  if (mmio->checkpoint_thread) {
-    s = pthread_cancel(mmio->checkpoint_thread);
-    if (__glibc_unlikely(s != 0)) {
-      HANDLE_ERROR("pthread_cancel");
-    }
-    PRINT("canceled checkpoint thread.");
-  }
+  unregister_autocommit(mmio);
+  cancel_checkpoint(mmio);
+  release_radixlog(&mmio->radixlog);
 
   s = munmap(mmio->start, mmio->end - mmio->start);
   if (__glibc_unlikely(s != 0)) {
@@ -458,14 +1036,69 @@ void release_mmio(mmio_t *mmio, int flags, int fd) {
   bravo_rwlock_destroy(&mmio->rwlock);
 
   init_mmio(mmio);
-  PUSH_COLLECTOR(mmio, local_mmio_collector, global_mmio_list);
+  mmio->record->ino = 0;
+  mmio->record->path[0] = '\0';
+  FLUSH(mmio->record, offsetof(mmio_record_t, path) + 1);
+  FENCE();
+  magazine_free(mmio_depot, mmio);
 }
 
-log_table_t *alloc_log_table(table_type_t type) {
+/*
+ * Return true if the free log blocks or index entries of any pool
+ * are below the given percentage. Since allocations fall back to
+ * remote nodes, the pools of a kind are counted over all nodes.
+ */
+bool check_log_pool_pressure(unsigned long percent) {
+  log_pool_t *pool;
+  arena_t *arena;
+  unsigned long free_cnt, total_cnt;
+  int i, node;
+
+  for (i = 0; i <= NR_LOG_SIZES; i++) {
+    free_cnt = 0;
+    total_cnt = 0;
+
+    for (node = 0; node < nr_numa_nodes; node++) {
+      /* Count the objects the pools can still carve. */
+      if (i < NR_LOG_SIZES) {
+        pool = &numa_pools[node].log_pools[i];
+        if (pool->global == NULL) {
+          continue;
+        }
+        free_cnt += pool->global->list_cnt + depot_free_cnt(pool->depot) +
+                    pool->uncarved +
+                    (pool->max_segments - pool->nr_active) * pool->nr_logs;
+        total_cnt += pool->max_segments * pool->nr_logs;
+      } else {
+        if (numa_pools[node].global_idx_list == NULL) {
+          continue;
+        }
+        arena = &numa_pools[node].idx_arena;
+        free_cnt += numa_pools[node].global_idx_list->list_cnt +
+                    depot_free_cnt(numa_pools[node].idx_depot) +
+                    numa_pools[node].free_chunk_cnt + arena_remaining(arena);
+        total_cnt += (arena->end - arena->base) / arena->obj_size;
+      }
+    }
+
+    if (free_cnt * 100 < total_cnt * percent) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static log_table_t *__alloc_log_table(table_type_t type, bool wait) {
+  depot_t *depot;
   log_table_t *table;
 
   PRINT("table type: %lu", (unsigned long)type);
-  POP_PROVIDER(table, log_table_t, local_table_provider, global_table_list);
+  depot = type == SPARSE_TABLE ? sparse_table_depot : table_depot;
+  table = (log_table_t *)(wait ? magazine_alloc(depot)
+                               : magazine_try_alloc(depot));
+  if (__glibc_unlikely(table == NULL)) {
+    return NULL;
+  }
 
   table->type = type;
   table->log_size = NR_LOG_SIZES;
@@ -473,48 +1106,312 @@ log_table_t *alloc_log_table(table_type_t type) {
   return table;
 }
 
+log_table_t *alloc_log_table(table_type_t type) {
+  return __alloc_log_table(type, true);
+}
+
+/*
+ * Same as alloc_log_table(), but return NULL instead of waiting if the
+ * tables run out. Writers take tables this way, like log blocks.
+ */
+log_table_t *try_alloc_log_table(table_type_t type) {
+  return __alloc_log_table(type, false);
+}
+
 void free_log_table(log_table_t *table) {
-  PUSH_COLLECTOR(table, local_table_collector, global_table_list);
+  if (table->type == SPARSE_TABLE) {
+    init_sparse_table(table);
+    magazine_free(sparse_table_depot, table);
+  } else {
+    init_table(table);
+    magazine_free(table_depot, table);
+  }
 }
 
-void *alloc_log_data(log_size_t log_size) {
+static void *alloc_node_log_data(log_pool_t *pool) {
+  log_segment_t *segment;
   void *data;
-  POP_PROVIDER(data, void *, local_log_provider[log_size],
-               global_log_list[log_size]);
+
+  while (true) {
+    data = magazine_try_alloc(pool->depot);
+    if (data == NULL) {
+      return NULL;
+    }
+    segment = get_log_segment(pool, data);
+
+    if (__glibc_likely(segment->state != SEGMENT_RETIRING)) {
+      break;
+    }
+    reclaim_log_data(pool, segment);
+  }
+
+  __sync_fetch_and_add(&segment->used, 1);
+  return data;
+}
+
+/*
+ * Allocate a log from the node of the calling thread, or from the
+ * nearest node that has one free. The node of the log is returned in
+ * *node. Return NULL if all the pools are exhausted.
+ */
+void *alloc_log_data(log_size_t log_size, int *node) {
+  void *data = NULL;
+  int local, i;
+
+  local = get_numa_node();
+
+  for (i = 0; i < nr_numa_nodes && data == NULL; i++) {
+    *node = get_fallback_node(local, i);
+    data = alloc_node_log_data(&numa_pools[*node].log_pools[log_size]);
+  }
+
+  if (__glibc_unlikely(data == NULL)) {
+    return NULL;
+  }
+
+  if (*node != local) {
+    __sync_fetch_and_add(&numa_pools[*node].remote_allocs, 1);
+  }
   return data;
 }
 
-void free_log_data(void *data, log_size_t log_size) {
-  PUSH_COLLECTOR(data, local_log_collector[log_size],
-                 global_log_list[log_size]);
+void free_log_data(void *data, log_size_t log_size, int node) {
+  log_pool_t *pool;
+  log_segment_t *segment;
+
+  pool = &numa_pools[node].log_pools[log_size];
+  segment = get_log_segment(pool, data);
+  __sync_fetch_and_sub(&segment->used, 1);
+
+  magazine_free(pool->depot, data);
 }
 
-idx_entry_t *alloc_idx_entry(log_size_t log_size) {
-  idx_entry_t *entry;
+static idx_entry_t *alloc_numa_idx_entry(void) {
+  idx_entry_t *entry = NULL;
+  int local, node, i;
 
-  POP_PROVIDER(entry, idx_entry_t, local_idx_provider, global_idx_list);
+  local = get_numa_node();
 
-  entry->log = alloc_log_data(log_size);
-  entry->list.next = NULL;
-  RWLOCK_INIT(entry->rwlockp);
+  for (i = 0; i < nr_numa_nodes && entry == NULL; i++) {
+    node = get_fallback_node(local, i);
+    entry = (idx_entry_t *)magazine_try_alloc(numa_pools[node].idx_depot);
+  }
+
+  if (__glibc_unlikely(entry == NULL)) {
+    return NULL;
+  }
 
+  if (node != local) {
+    __sync_fetch_and_add(&numa_pools[node].remote_allocs, 1);
+  }
   return entry;
 }
 
-void free_idx_entry(idx_entry_t *entry, log_size_t log_size) {
-  free_log_data(entry->log, log_size);
+/*
+ * Give the entry a log block. Return false if the log pools are
+ * exhausted.
+ */
+bool attach_idx_log(idx_entry_t *entry, log_size_t log_size) {
+  idx_record_t *record = entry->record;
+  void *log;
+
+  log = alloc_log_data(log_size, &entry->log_node);
+  if (__glibc_unlikely(log == NULL)) {
+    return false;
+  }
+  entry->log_size = log_size;
+  record->log_off = log - numa_pools[entry->log_node].log_pools[log_size].base;
+  record->log_size = log_size;
+  record->log_node = entry->log_node;
+  __atomic_store_n(&entry->log, log, __ATOMIC_RELAXED);
+  return true;
+}
+
+/*
+ * Make the entry ready to be published. An entry for appends, which are
+ * written in place, goes without a log block until a logged write needs
+ * one. Return false if the log pools are exhausted.
+ */
+bool alloc_idx_log(idx_entry_t *entry, log_size_t log_size, bool with_log) {
+  if (with_log) {
+    if (__glibc_unlikely(!attach_idx_log(entry, log_size))) {
+      return false;
+    }
+  } else {
+    entry->log = NULL;
+    entry->log_size = log_size;
+  }
+  entry->list.next = NULL;
+  vlock_init(&entry->lock);
+  return true;
+}
+
+/*
+ * Return the log block of the entry and leave the entry freed.
+ */
+void free_idx_log(idx_entry_t *entry, log_size_t log_size) {
+  if (entry->log != NULL) {
+    free_log_data(entry->log, log_size, entry->log_node);
+  }
   entry->log = NULL;
   entry->united = 0;
-  entry->dst = NULL;
-  RWLOCK_DESTROY(entry->rwlockp);
-  PUSH_COLLECTOR(entry, local_idx_collector, global_idx_list);
+  entry->dst = 0;
+  vlock_invalidate(&entry->lock);
+  entry->record->united = 0;
+  entry->record->dst = 0;
+  FLUSH(entry->record, sizeof(idx_record_t));
 }
 
-void init_allocator(void) {
-  get_env();
+/*
+ * Return NULL if the index entries or the logs are exhausted.
+ */
+idx_entry_t *alloc_idx_entry(log_size_t log_size, bool with_log) {
+  idx_entry_t *entry;
+
+  entry = alloc_numa_idx_entry();
+  if (__glibc_unlikely(entry == NULL)) {
+    return NULL;
+  }
+
+  if (__glibc_unlikely(!alloc_idx_log(entry, log_size, with_log))) {
+    magazine_free(numa_pools[get_idx_node(entry)].idx_depot, entry);
+    return NULL;
+  }
+  return entry;
+}
+
+void free_idx_entry(idx_entry_t *entry, log_size_t log_size) {
+  free_idx_log(entry, log_size);
+  magazine_free(numa_pools[get_idx_node(entry)].idx_depot, entry);
+}
+
+/*
+ * A chunk is a run of NR_ENTRIES(log_size) index entries, one for each
+ * block of a full leaf table, so that the metadata of neighboring blocks
+ * is contiguous. Chunks are carved from the index pool of a node, like
+ * the single entries, so recovery finds them in the same place. Their
+ * entries start freed, and freed chunks are kept for the next tables of
+ * the same log size.
+ */
+static idx_entry_t *alloc_node_idx_chunk(int node, log_size_t log_size) {
+  numa_pool_t *numa_pool;
+  arena_t *arena;
+  idx_entry_t *chunk = NULL;
+  unsigned long i, n = NR_ENTRIES(log_size);
+
+  numa_pool = &numa_pools[node];
+  arena = &numa_pool->idx_arena;
+
+  MUTEX_LOCK(&numa_pool->global_idx_list->mutex);
+  if (!slist_empty(&numa_pool->free_chunks[log_size])) {
+    chunk = SLIST_ENTRY(slist_pop(&numa_pool->free_chunks[log_size]),
+                        idx_entry_t, list);
+    numa_pool->free_chunk_cnt -= n;
+    MUTEX_UNLOCK(&numa_pool->global_idx_list->mutex);
+    return chunk;
+  }
+
+  if (arena_remaining(arena) >= n) {
+    chunk = (idx_entry_t *)arena->next;
+    arena->next += n * sizeof(idx_entry_t);
+  }
+  MUTEX_UNLOCK(&numa_pool->global_idx_list->mutex);
+
+  if (chunk != NULL) {
+    for (i = 0; i < n; i++) {
+      init_idx(&chunk[i]);
+      vlock_invalidate(&chunk[i].lock);
+    }
+  }
+  return chunk;
+}
+
+idx_entry_t *alloc_idx_chunk(log_size_t log_size) {
+  idx_entry_t *chunk;
+  int local, i;
+
+  local = get_numa_node();
+
+  for (i = 0; i < nr_numa_nodes; i++) {
+    chunk = alloc_node_idx_chunk(get_fallback_node(local, i), log_size);
+    if (chunk != NULL) {
+      return chunk;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * All the entries of the chunk must have been freed.
+ */
+void free_idx_chunk(idx_entry_t *chunk, log_size_t log_size) {
+  numa_pool_t *numa_pool;
+
+  numa_pool = &numa_pools[get_idx_node(chunk)];
+
+  MUTEX_LOCK(&numa_pool->global_idx_list->mutex);
+  slist_push(&chunk->list, &numa_pool->free_chunks[log_size]);
+  numa_pool->free_chunk_cnt += NR_ENTRIES(log_size);
+  MUTEX_UNLOCK(&numa_pool->global_idx_list->mutex);
+}
+
+/*
+ * The usage counters of a node are kept by the per-CPU caches of its
+ * depots, so that counting does not bounce a shared cache line.
+ */
+void get_numa_stats(int node, numa_stats_t *stats) {
+  numa_pool_t *numa_pool;
+  int i;
 
-  create_global_idx_list();
-  create_global_log_list();
+  memset(stats, 0, sizeof(numa_stats_t));
+  numa_pool = &numa_pools[node];
+
+  for (i = 0; i < NR_LOG_SIZES; i++) {
+    if (numa_pool->log_pools[i].depot) {
+      get_depot_stats(numa_pool->log_pools[i].depot, &stats->log_allocs,
+                      &stats->log_frees);
+    }
+  }
+  if (numa_pool->idx_depot) {
+    get_depot_stats(numa_pool->idx_depot, &stats->idx_allocs,
+                    &stats->idx_frees);
+  }
+  stats->log_allocs -= numa_pool->reclaimed_logs;
+  stats->remote_allocs = numa_pool->remote_allocs;
+}
+
+static void create_pools(void) {
+  int node;
+
+  init_numa(nr_numa_nodes);
+
+  for (node = 0; node < nr_numa_nodes; node++) {
+    create_logdir(numa_pools[node].logdir_path);
+    create_global_idx_list(node);
+    create_global_log_list(node);
+  }
   create_global_mmio_list();
+  create_tx_records();
   create_global_table_list();
+  create_global_sparse_table_list();
+
+  allocator_started = true;
+}
+
+/*
+ * The pools are created at the first open of an O_ATOMIC file,
+ * so that processes which never use Libnvmmio do not pay for them.
+ */
+void start_allocator(void) {
+  int s;
+
+  s = pthread_once(&allocator_once, create_pools);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("pthread_once");
+  }
+}
+
+void init_allocator(void) {
+  get_env();
+  recover_logs(pmem_paths, nr_numa_nodes, libnvmmio_pid);
 }
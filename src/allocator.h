@@ -2,84 +2,110 @@
 #define LIBNVMMIO_ALLOCATOR_H
 
 #include <pthread.h>
+#include <stdbool.h>
 
 #include "lock.h"
 #include "mmio.h"
 #include "radixlog.h"
 #include "slist.h"
+#include "tx.h"
 
+#define DIR_PATH "%s/.libnvmmio-%lu"
+#define DIR_PREFIX ".libnvmmio-"
+#define LOGFILE_PATH "%s/%s-%d.log"
+#define LOG_SEGMENT_NAME "logs-%d"
+
+/*
+ * Free list nodes live in a side array of the global list, one per
+ * object slot, so pushing and popping objects never calls malloc().
+ * Threads do not use the global lists directly, but go through the
+ * per-CPU magazines of magazine.c.
+ */
 typedef struct freelist_node_struct {
   struct slist_head list;
-  struct slist_head skip;
   void *ptr;
 } fnode_t;
 
 typedef struct freelist_struct {
   pthread_mutex_t mutex;
+  pthread_cond_t freed; /* signaled for waiters when objects come back */
+  unsigned long waiters;
   struct slist_head list_head;
-  struct slist_head skip_head;
   unsigned long list_cnt;
-  unsigned long skip_cnt;
-  unsigned long skip_unit;
+  unsigned long batch; /* objects carved at a time */
+  unsigned long total_cnt;
+  fnode_t *nodes;
+  void *base;
+  size_t obj_size;
+  bool (*grow)(struct freelist_struct *global);
+  void *grow_arg;
 } flist_t;
 
+/*
+ * Usage counters of the pools of a NUMA node. Remote allocations are
+ * the ones served to threads running on another node.
+ */
+typedef struct numa_stats_struct {
+  unsigned long log_allocs;
+  unsigned long log_frees;
+  unsigned long idx_allocs;
+  unsigned long idx_frees;
+  unsigned long remote_allocs;
+} numa_stats_t;
+
 void init_allocator(void);
+void start_allocator(void);
+void remove_logdir(const char *path);
+bool check_log_pool_pressure(unsigned long percent);
+void shrink_log_pools(void);
 
-mmio_t *get_new_mmio(int fd, int flags, unsigned long ino, unsigned long fsize);
+mmio_t *get_new_mmio(int fd, int flags, unsigned long ino, unsigned long fsize,
+                     const char *path);
 void release_mmio(mmio_t *mmio, int flags, int fd);
 
+tx_record_t *alloc_tx_record(void);
+void free_tx_record(tx_record_t *record);
+
 log_table_t *alloc_log_table(table_type_t type);
+log_table_t *try_alloc_log_table(table_type_t type);
 void free_log_table(log_table_t *table);
 
-idx_entry_t *alloc_idx_entry(log_size_t log_size);
+idx_entry_t *alloc_idx_entry(log_size_t log_size, bool with_log);
 void free_idx_entry(idx_entry_t *entry, log_size_t log_size);
+bool attach_idx_log(idx_entry_t *entry, log_size_t log_size);
+bool alloc_idx_log(idx_entry_t *entry, log_size_t log_size, bool with_log);
+void free_idx_log(idx_entry_t *entry, log_size_t log_size);
+idx_entry_t *alloc_idx_chunk(log_size_t log_size);
+void free_idx_chunk(idx_entry_t *chunk, log_size_t log_size);
 
-void *alloc_log_data(log_size_t log_size);
-void free_log_data(void *data, log_size_t log_size);
+void *alloc_log_data(log_size_t log_size, int *node);
+void free_log_data(void *data, log_size_t log_size, int node);
 
-flist_t *alloc_flist(unsigned long skip_unit);
-fnode_t *get_fnode(void);
-void put_fnode(fnode_t *node);
+void get_numa_stats(int node, numa_stats_t *stats);
+
+flist_t *alloc_flist(unsigned long batch);
+void init_fnodes(flist_t *global, void *base, size_t obj_size,
+                 unsigned long count);
 
 void put_global(fnode_t *node, flist_t *global);
-void fill_local_provider(flist_t *local, flist_t *global);
-void put_local_collector(fnode_t *node, flist_t *local_collector,
-                         flist_t *global);
+unsigned long get_global(flist_t *global, void **objs, unsigned long n,
+                         bool wait);
+void put_global_objs(flist_t *global, void **objs, unsigned long n);
+
+static inline fnode_t *get_fnode(flist_t *global, void *obj) {
+  return &global->nodes[(obj - global->base) / global->obj_size];
+}
 
 /*
  * Before calling PUSH_GLOBAL(), global->mutex must be acquired.
  */
-#define PUSH_GLOBAL(obj_, global_) \
-  do {                             \
-    fnode_t *node_;                \
-    node_ = get_fnode();           \
-    node_->ptr = obj_;             \
-    put_global(node_, global_);    \
-  } while (0)
-
-#define POP_PROVIDER(obj_, type_, provider_, global_)                     \
-  do {                                                                    \
-    fnode_t *node_;                                                       \
-    if (__glibc_unlikely(provider_ == NULL)) {                            \
-      provider_ = alloc_flist(0);                                         \
-    }                                                                     \
-    if (__glibc_unlikely(slist_empty(&provider_->list_head))) {           \
-      fill_local_provider(provider_, global_);                            \
-    }                                                                     \
-    node_ = SLIST_ENTRY(slist_pop(&provider_->list_head), fnode_t, list); \
-    obj_ = (type_ *)node_->ptr;                                           \
-    put_fnode(node_);                                                     \
-  } while (0)
-
-#define PUSH_COLLECTOR(obj_, collector_, global_)    \
-  do {                                               \
-    fnode_t *node_;                                  \
-    if (__glibc_unlikely(collector_ == NULL)) {      \
-      collector_ = alloc_flist(global_->skip_unit);  \
-    }                                                \
-    node_ = get_fnode();                             \
-    node_->ptr = obj_;                               \
-    put_local_collector(node_, collector_, global_); \
+#define PUSH_GLOBAL(obj_, global_)    \
+  do {                                \
+    void *ptr_ = (obj_);              \
+    fnode_t *node_;                   \
+    node_ = get_fnode(global_, ptr_); \
+    node_->ptr = ptr_;                \
+    put_global(node_, global_);       \
   } while (0)
 
 #endif /* LIBNVMMIO_ALLOCATOR_H */
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "autocommit.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "checkpoint.h"
+#include "config.h"
+#include "debug.h"
+#include "env.h"
+#include "list.h"
+#include "lock.h"
+#include "mmio.h"
+
+/*
+ * Libnvmmio keeps logged data until fsync() commits the epoch.
+ * Applications that rarely call fsync() would run the log pools dry,
+ * so a committer thread commits a file by itself when
+ *
+ *   - more than AUTO_COMMIT_LOG_SIZE bytes were logged in the epoch,
+ *   - the epoch is older than AUTO_COMMIT_PERIOD milliseconds, or
+ *   - the free objects of a log pool fall below LOG_POOL_LOW_WATERMARK
+ *     percent. The file is then also checkpointed right away.
+ *
+ * Below LOG_POOL_MIN_WATERMARK percent, writers wait for the committer
+ * before they take any lock, instead of running out of logs. Counting
+ * the free logs reads the pools of every node, so the committer does it
+ * once per round and writers only test the flag it leaves. A writer
+ * that runs out anyway lets go of its locks and its epoch, and waits
+ * for the committer the same way.
+ * Each round also returns idle segments of the elastic log pools.
+ * Files held by an open transaction are left to it, whatever the
+ * trigger. All thresholds can be overridden by environment variables of
+ * the same names.
+ */
+
+typedef struct autocommit_struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t kick;  /* a threshold was crossed */
+  pthread_cond_t space; /* the committer finished a round */
+  struct list_head mmios;
+  unsigned long period;
+  unsigned long log_size;
+  unsigned long low_watermark;
+  unsigned long min_watermark;
+  unsigned long rounds;
+  bool throttle; /* below the min watermark at the end of the last round */
+} autocommit_t;
+
+#define THROTTLE_WAIT_MS (10)
+
+static autocommit_t committer = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    LIST_HEAD_INIT(committer.mmios),
+    AUTO_COMMIT_PERIOD,
+    AUTO_COMMIT_LOG_SIZE,
+    LOG_POOL_LOW_WATERMARK,
+    LOG_POOL_MIN_WATERMARK,
+    0,
+    false,
+};
+static pthread_once_t committer_once = PTHREAD_ONCE_INIT;
+
+static inline void get_deadline(struct timespec *ts, unsigned long ms) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/*
+ * A file held by an open transaction is committed by the transaction
+ * alone. If the logs run short meanwhile, its writers wait.
+ */
+static inline bool need_commit(mmio_t *mmio, unsigned long now,
+                               bool pressure) {
+  if (mmio->logged == 0 ||
+      __atomic_load_n(&mmio->tx_holds, __ATOMIC_RELAXED) > 0) {
+    return false;
+  }
+  return pressure || mmio->logged >= committer.log_size ||
+         (committer.period && now - mmio->epoch_time >= committer.period);
+}
+
+static void *autocommit_thread_func(void *parm) {
+  struct timespec deadline;
+  mmio_t *mmio;
+  unsigned long now;
+  bool pressure;
+
+  (void)parm;
+
+  MUTEX_LOCK(&committer.mutex);
+
+  while (true) {
+    get_deadline(&deadline, committer.period ? committer.period : 1000);
+    pthread_cond_timedwait(&committer.kick, &committer.mutex, &deadline);
+
+    now = get_coarse_time_ms();
+    pressure = check_log_pool_pressure(committer.low_watermark);
+
+    LIST_FOR_EACH_ENTRY(mmio, &committer.mmios, autocommit_list) {
+      if (need_commit(mmio, now, pressure)) {
+        PRINT("auto-commit: mmio->ino=%lu, logged=%lu", mmio->ino,
+              mmio->logged);
+        commit_mmio(mmio);
+        if (pressure) {
+          checkpoint_mmio(mmio);
+        }
+      }
+    }
+
+    /* Return idle log segments once the pools are quiet. */
+    if (!pressure) {
+      shrink_log_pools();
+    }
+
+    __atomic_store_n(&committer.throttle,
+                     check_log_pool_pressure(committer.min_watermark),
+                     __ATOMIC_RELAXED);
+    committer.rounds++;
+    pthread_cond_broadcast(&committer.space);
+  }
+
+  MUTEX_UNLOCK(&committer.mutex);
+  return NULL;
+}
+
+static void init_autocommit(void) {
+  pthread_t thread;
+  pthread_attr_t attr;
+  int s;
+
+  committer.period = get_env_ulong("AUTO_COMMIT_PERIOD", AUTO_COMMIT_PERIOD);
+  committer.log_size =
+      get_env_ulong("AUTO_COMMIT_LOG_SIZE", AUTO_COMMIT_LOG_SIZE);
+  committer.low_watermark =
+      get_env_ulong("LOG_POOL_LOW_WATERMARK", LOG_POOL_LOW_WATERMARK);
+  committer.min_watermark =
+      get_env_ulong("LOG_POOL_MIN_WATERMARK", LOG_POOL_MIN_WATERMARK);
+
+  s = pthread_attr_init(&attr);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("pthread_attr_init");
+  }
+
+  s = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("pthread_attr_setdetachstate");
+  }
+
+  s = pthread_create(&thread, &attr, autocommit_thread_func, NULL);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("pthread_create");
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void register_autocommit(mmio_t *mmio) {
+  pthread_once(&committer_once, init_autocommit);
+
+  mmio->logged = 0;
+  mmio->epoch_time = get_coarse_time_ms();
+
+  MUTEX_LOCK(&committer.mutex);
+  list_add_tail(&mmio->autocommit_list, &committer.mmios);
+  MUTEX_UNLOCK(&committer.mutex);
+}
+
+void unregister_autocommit(mmio_t *mmio) {
+  MUTEX_LOCK(&committer.mutex);
+  list_del_init(&mmio->autocommit_list);
+  MUTEX_UNLOCK(&committer.mutex);
+}
+
+/*
+ * This may be called with the locks of an mmio held, so it must not take
+ * committer.mutex. A lost wakeup only delays the committer until its
+ * next periodic round.
+ */
+void kick_autocommit(void) {
+  pthread_once(&committer_once, init_autocommit);
+  pthread_cond_signal(&committer.kick);
+}
+
+void account_autocommit(mmio_t *mmio, unsigned long len) {
+  unsigned long logged;
+
+  logged = __sync_add_and_fetch(&mmio->logged, len);
+
+  if (__glibc_unlikely(logged >= committer.log_size &&
+                       logged - len < committer.log_size)) {
+    kick_autocommit();
+  }
+}
+
+/*
+ * Wait until the committer has committed and checkpointed the files.
+ * The caller must not hold any lock or epoch pin.
+ */
+void wait_for_log_space(void) {
+  struct timespec deadline;
+  unsigned long rounds;
+  int s;
+
+  pthread_once(&committer_once, init_autocommit);
+
+  MUTEX_LOCK(&committer.mutex);
+  rounds = committer.rounds;
+  pthread_cond_signal(&committer.kick);
+
+  while (rounds == committer.rounds) {
+    get_deadline(&deadline, THROTTLE_WAIT_MS);
+    s = pthread_cond_timedwait(&committer.space, &committer.mutex, &deadline);
+    if (s == ETIMEDOUT) {
+      pthread_cond_signal(&committer.kick);
+    }
+  }
+  MUTEX_UNLOCK(&committer.mutex);
+}
+
+/*
+ * Called by writers before they take any lock.
+ * If a log pool was almost exhausted at the end of the last round of the
+ * committer, wait for the next one.
+ */
+void throttle_writer(void) {
+  if (__glibc_likely(!__atomic_load_n(&committer.throttle, __ATOMIC_RELAXED))) {
+    return;
+  }
+
+  wait_for_log_space();
+  PRINT("writer throttled by log pool pressure");
+}
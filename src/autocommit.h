@@ -0,0 +1,22 @@
+#ifndef LIBNVMMIO_AUTOCOMMIT_H
+#define LIBNVMMIO_AUTOCOMMIT_H
+
+#include <time.h>
+
+#include "mmio.h"
+
+void register_autocommit(mmio_t *mmio);
+void unregister_autocommit(mmio_t *mmio);
+void kick_autocommit(void);
+void throttle_writer(void);
+void wait_for_log_space(void);
+void account_autocommit(mmio_t *mmio, unsigned long len);
+
+static inline unsigned long get_coarse_time_ms(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (now.tv_sec * 1000UL) + (now.tv_nsec / 1000000UL);
+}
+
+#endif /* LIBNVMMIO_AUTOCOMMIT_H */
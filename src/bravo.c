@@ -3,39 +3,45 @@
  * introduced in the paper below.
  *
  * BRAVO—Biased Locking for Reader-Writer Locks (USENIX ATC '19)
+ *
+ * Each thread gets a slot index once, and uses the slot of that index in
+ * every lock. A thread owns a slot while it holds the read lock through
+ * it, so it can tell on unlock whether it took the fast path, even when
+ * more threads than slots collide on the same index.
  */
 #include "bravo.h"
 
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <x86intrin.h>
 
-#define BILLION 1000000000L
 #define N 9
-#define NR_ENTRIES 4096
 
-volatile bravo_rwlock_t *visible_readers[NR_ENTRIES] = {
-    0,
-};
+static unsigned int next_slot;
 
-static inline int mix32(unsigned long z) {
-  z = (z ^ (z >> 33)) * 0xff51afd7ed558ccdL;
-  z = (z ^ (z >> 33)) * 0xc4ceb9fe1a85ec53L;
-  return abs((int)(z >> 32));
-}
+/*
+ * The slot index of the thread, whose address also tells the threads
+ * apart. Libnvmmio is preloaded, so its TLS can be reached directly
+ * instead of through __tls_get_addr() on every lock operation.
+ */
+static __thread int my_slot __attribute__((tls_model("initial-exec"))) = -1;
 
-static inline int bravo_hash(bravo_rwlock_t *l) {
-  unsigned long a, b;
-  a = (unsigned long)pthread_self();
-  b = (unsigned long)l;
-  return mix32(a + b) % NR_ENTRIES;
+static inline bravo_slot_t *bravo_slot(bravo_rwlock_t *l) {
+  if (__glibc_unlikely(my_slot < 0)) {
+    my_slot = __sync_fetch_and_add(&next_slot, 1) % BRAVO_READER_SLOTS;
+  }
+  return &l->readers[my_slot];
 }
 
 void bravo_rwlock_init(bravo_rwlock_t *l) {
-  int s;
+  int s, i;
 
   l->rbias = true;
   l->inhibit_until = 0;
+  for (i = 0; i < BRAVO_READER_SLOTS; i++) {
+    l->readers[i].owner = NULL;
+  }
 
   s = pthread_rwlock_init(&l->underlying, NULL);
   if (__glibc_unlikely(s != 0)) {
@@ -52,56 +58,60 @@ void bravo_rwlock_destroy(bravo_rwlock_t *l) {
   }
 }
 
-void bravo_read_lock(bravo_rwlock_t *l) {
-  struct timespec now;
-  unsigned long now_time;
-  int slot, s;
-
-  if (l->rbias) {
-    slot = bravo_hash(l);
+/*
+ * Try the fast path: publish the thread in its slot, and check that no
+ * writer has revoked the bias meanwhile.
+ */
+static inline bool bravo_fast_read_lock(bravo_rwlock_t *l) {
+  bravo_slot_t *slot;
+  void *expected = NULL;
 
-    if (__sync_bool_compare_and_swap(&visible_readers[slot], NULL, l)) {
-      if (l->rbias) {
-        return;
-      }
+  if (!__atomic_load_n(&l->rbias, __ATOMIC_RELAXED)) {
+    return false;
+  }
 
-      visible_readers[slot] = NULL;
+  slot = bravo_slot(l);
+  if (__atomic_compare_exchange_n(&slot->owner, &expected, &my_slot, false,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    if (__atomic_load_n(&l->rbias, __ATOMIC_SEQ_CST)) {
+      return true;
     }
+    __atomic_store_n(&slot->owner, NULL, __ATOMIC_RELEASE);
   }
+  return false;
+}
 
-  /* slow-path */
-  s = pthread_rwlock_rdlock(&l->underlying);
-  if (__glibc_unlikely(s != 0)) {
-    perror("pthread_rwlock_rdlock");
+/*
+ * Restore the bias once the inhibition set by the last revocation ends.
+ * The caller holds the underlying lock as a reader.
+ */
+static inline void bravo_rearm(bravo_rwlock_t *l) {
+  if (!__atomic_load_n(&l->rbias, __ATOMIC_RELAXED) &&
+      __rdtsc() >= l->inhibit_until) {
+    __atomic_store_n(&l->rbias, true, __ATOMIC_RELAXED);
   }
+}
 
-  s = clock_gettime(CLOCK_MONOTONIC, &now);
-  if (__glibc_unlikely(s != 0)) {
-    perror("clock_gettime");
-  }
+void bravo_read_lock(bravo_rwlock_t *l) {
+  int s;
 
-  now_time = (now.tv_sec * BILLION) + now.tv_nsec;
+  if (bravo_fast_read_lock(l)) {
+    return;
+  }
 
-  if (l->rbias == false && now_time >= l->inhibit_until) {
-    l->rbias = true;
+  /* slow-path */
+  s = pthread_rwlock_rdlock(&l->underlying);
+  if (__glibc_unlikely(s != 0)) {
+    perror("pthread_rwlock_rdlock");
   }
+  bravo_rearm(l);
 }
 
 int bravo_read_trylock(bravo_rwlock_t *l) {
-  struct timespec now;
-  unsigned long now_time;
-  int slot, s;
-
-  if (l->rbias) {
-    slot = bravo_hash(l);
-
-    if (__sync_bool_compare_and_swap(&visible_readers[slot], NULL, l)) {
-      if (l->rbias) {
-        return 0;
-      }
+  int s;
 
-      visible_readers[slot] = NULL;
-    }
+  if (bravo_fast_read_lock(l)) {
+    return 0;
   }
 
   /* slow-path */
@@ -109,27 +119,18 @@ int bravo_read_trylock(bravo_rwlock_t *l) {
   if (__glibc_unlikely(s != 0)) {
     return s;
   }
-
-  s = clock_gettime(CLOCK_MONOTONIC, &now);
-  if (__glibc_unlikely(s != 0)) {
-    perror("clock_gettime");
-  }
-
-  now_time = (now.tv_sec * BILLION) + now.tv_nsec;
-
-  if (l->rbias == false && now_time >= l->inhibit_until) {
-    l->rbias = true;
-  }
+  bravo_rearm(l);
   return 0;
 }
 
 void bravo_read_unlock(bravo_rwlock_t *l) {
-  int slot, s;
+  bravo_slot_t *slot;
+  int s;
 
-  slot = bravo_hash(l);
+  slot = bravo_slot(l);
 
-  if (visible_readers[slot] != NULL) {
-    visible_readers[slot] = NULL;
+  if (__atomic_load_n(&slot->owner, __ATOMIC_RELAXED) == &my_slot) {
+    __atomic_store_n(&slot->owner, NULL, __ATOMIC_RELEASE);
   } else {
     s = pthread_rwlock_unlock(&l->underlying);
     if (__glibc_unlikely(s != 0)) {
@@ -138,33 +139,31 @@ void bravo_read_unlock(bravo_rwlock_t *l) {
   }
 }
 
+/*
+ * Wait for the visible readers to leave. Readers hold the lock briefly,
+ * so the writer spins first, and yields the CPU only if a reader takes
+ * longer, e.g. because it was preempted.
+ */
 static inline void revocate(bravo_rwlock_t *l) {
-  struct timespec start, now;
-  unsigned long start_time, now_time;
-  int s, i;
-
-  l->rbias = false;
-
-  s = clock_gettime(CLOCK_MONOTONIC, &start);
-  if (__glibc_unlikely(s != 0)) {
-    perror("clock_gettime");
-  }
-
-  for (i = 0; i < NR_ENTRIES; i++) {
-    while (visible_readers[i] == l) {
-      usleep(1);
+  unsigned long start, now;
+  int i, spins;
+
+  __atomic_store_n(&l->rbias, false, __ATOMIC_SEQ_CST);
+  start = __rdtsc();
+
+  for (i = 0; i < BRAVO_READER_SLOTS; i++) {
+    spins = 0;
+    while (__atomic_load_n(&l->readers[i].owner, __ATOMIC_ACQUIRE) != NULL) {
+      if (++spins < BRAVO_REVOKE_SPINS) {
+        _mm_pause();
+      } else {
+        sched_yield();
+      }
     }
   }
 
-  s = clock_gettime(CLOCK_MONOTONIC, &now);
-  if (__glibc_unlikely(s != 0)) {
-    perror("clock_gettime");
-  }
-
-  start_time = (start.tv_sec * BILLION) + start.tv_nsec;
-  now_time = (now.tv_sec * BILLION) + now.tv_nsec;
-
-  l->inhibit_until = now_time + ((now_time - start_time) * N);
+  now = __rdtsc();
+  l->inhibit_until = now + ((now - start) * N);
 }
 
 void bravo_write_lock(bravo_rwlock_t *l) {
@@ -175,7 +174,7 @@ void bravo_write_lock(bravo_rwlock_t *l) {
     perror("pthread_rwlock_wrlock");
   }
 
-  if (l->rbias) {
+  if (__atomic_load_n(&l->rbias, __ATOMIC_RELAXED)) {
     revocate(l);
   }
 }
@@ -188,7 +187,7 @@ int bravo_write_trylock(bravo_rwlock_t *l) {
     return s;
   }
 
-  if (l->rbias) {
+  if (__atomic_load_n(&l->rbias, __ATOMIC_RELAXED)) {
     revocate(l);
   }
   return 0;
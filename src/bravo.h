@@ -11,10 +11,22 @@
 #include <stdbool.h>
 #include <time.h>
 
+#include "config.h"
+
+/*
+ * A visible reader publishes itself in a slot of the lock. The slots
+ * belong to the lock, so that readers of different locks never share a
+ * cache line, and each slot has a cache line of its own.
+ */
+typedef struct bravo_slot_struct {
+  void *owner; /* the reader thread, NULL if the slot is free */
+} __attribute__((aligned(CACHELINE_SIZE))) bravo_slot_t;
+
 typedef struct bravo_rwlock_struct {
   bool rbias;
-  unsigned long inhibit_until;
+  unsigned long inhibit_until; /* in TSC ticks */
   pthread_rwlock_t underlying;
+  bravo_slot_t readers[BRAVO_READER_SLOTS];
 } bravo_rwlock_t;
 
 void bravo_rwlock_init(bravo_rwlock_t *);
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include "checkpoint.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "debug.h"
+#include "env.h"
+#include "list.h"
+#include "lock.h"
+#include "mmio.h"
+
+/*
+ * A fixed number of checkpoint workers is shared by all mmios.
+ * commit_mmio() queues an mmio when its epoch advances, and a worker
+ * checkpoints the entries of the old epochs. Workers sleep while the
+ * queue is empty.
+ *
+ * NR_CHECKPOINT_THREADS sets the number of workers, and
+ * CHECKPOINT_CPUS (e.g. "0-3,8") pins them to CPUs in turn.
+ */
+
+typedef struct checkpoint_pool_struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work; /* an mmio is queued */
+  pthread_cond_t done; /* a worker finished an mmio */
+  struct list_head queue;
+  int nr_workers;
+} checkpoint_pool_t;
+
+static checkpoint_pool_t pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, LIST_HEAD_INIT(pool.queue), 0,
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void *checkpoint_worker_func(void *parm) {
+  mmio_t *mmio;
+  unsigned long pending;
+
+  (void)parm;
+
+  while (true) {
+    MUTEX_LOCK(&pool.mutex);
+    while (list_empty(&pool.queue)) {
+      pthread_cond_wait(&pool.work, &pool.mutex);
+    }
+    mmio = CONTAINER_OF(pool.queue.next, mmio_t, checkpoint_list);
+    list_del_init(&mmio->checkpoint_list);
+    mmio->checkpoint_queued = false;
+    mmio->checkpoint_running = true;
+    MUTEX_UNLOCK(&pool.mutex);
+
+    PRINT("checkpoint mmio->ino=%lu", mmio->ino);
+    pending = checkpoint_mmio(mmio);
+
+    /* Busy entries are retried after a while. */
+    if (pending > 0) {
+      usleep((useconds_t)SYNC_PERIOD);
+    }
+
+    MUTEX_LOCK(&pool.mutex);
+    mmio->checkpoint_running = false;
+    if (pending > 0 && !mmio->checkpoint_queued) {
+      list_add_tail(&mmio->checkpoint_list, &pool.queue);
+      mmio->checkpoint_queued = true;
+    }
+    pthread_cond_broadcast(&pool.done);
+    MUTEX_UNLOCK(&pool.mutex);
+  }
+
+  return NULL;
+}
+
+static void init_checkpoint_pool(void) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  cpu_set_t cpuset;
+  char *cpu_list;
+  int cpus[CPU_SETSIZE];
+  int i, nr_cpus = 0, s;
+
+  pool.nr_workers =
+      (int)get_env_ulong("NR_CHECKPOINT_THREADS", NR_CHECKPOINT_THREADS);
+  if (pool.nr_workers <= 0) {
+    pool.nr_workers = NR_CHECKPOINT_THREADS;
+  }
+
+  cpu_list = getenv("CHECKPOINT_CPUS");
+  if (cpu_list != NULL) {
+    nr_cpus = parse_cpu_list(cpu_list, cpus, CPU_SETSIZE);
+  }
+
+  for (i = 0; i < pool.nr_workers; i++) {
+    s = pthread_attr_init(&attr);
+    if (__glibc_unlikely(s != 0)) {
+      HANDLE_ERROR("pthread_attr_init");
+    }
+
+    s = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (__glibc_unlikely(s != 0)) {
+      HANDLE_ERROR("pthread_attr_setdetachstate");
+    }
+
+    if (nr_cpus > 0) {
+      CPU_ZERO(&cpuset);
+      CPU_SET(cpus[i % nr_cpus], &cpuset);
+      s = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+      if (__glibc_unlikely(s != 0)) {
+        HANDLE_ERROR("pthread_attr_setaffinity_np");
+      }
+    }
+
+    s = pthread_create(&thread, &attr, checkpoint_worker_func, NULL);
+    if (__glibc_unlikely(s != 0)) {
+      HANDLE_ERROR("pthread_create");
+    }
+    pthread_attr_destroy(&attr);
+  }
+  PRINT("created %d checkpoint workers", pool.nr_workers);
+}
+
+void request_checkpoint(mmio_t *mmio) {
+  pthread_once(&pool_once, init_checkpoint_pool);
+
+  MUTEX_LOCK(&pool.mutex);
+  if (!mmio->checkpoint_queued) {
+    list_add_tail(&mmio->checkpoint_list, &pool.queue);
+    mmio->checkpoint_queued = true;
+    pthread_cond_signal(&pool.work);
+  }
+  MUTEX_UNLOCK(&pool.mutex);
+}
+
+/*
+ * Remove the mmio from the queue and wait until no worker uses it.
+ */
+void cancel_checkpoint(mmio_t *mmio) {
+  MUTEX_LOCK(&pool.mutex);
+  while (mmio->checkpoint_queued || mmio->checkpoint_running) {
+    if (mmio->checkpoint_queued) {
+      list_del_init(&mmio->checkpoint_list);
+      mmio->checkpoint_queued = false;
+    }
+    if (mmio->checkpoint_running) {
+      pthread_cond_wait(&pool.done, &pool.mutex);
+    }
+  }
+  MUTEX_UNLOCK(&pool.mutex);
+}
@@ -0,0 +1,9 @@
+#ifndef LIBNVMMIO_CHECKPOINT_H
+#define LIBNVMMIO_CHECKPOINT_H
+
+#include "mmio.h"
+
+void request_checkpoint(mmio_t *mmio);
+void cancel_checkpoint(mmio_t *mmio);
+
+#endif /* LIBNVMMIO_CHECKPOINT_H */
@@ -7,13 +7,36 @@
 #define NR_MMIOS (MAX_FD << 1)
 #define BASIC_MMAP_SIZE (1UL << 26) /* 64MB */
 #define LOG_FILE_SIZE (1UL << 32)   /* 4GB */
+#define LOG_SEGMENT_SIZE (1UL << 26) /* 64MB, a multiple of the largest log */
+#define LOG_POOL_FLOOR LOG_SEGMENT_SIZE
+#define LOG_POOL_CEILING LOG_FILE_SIZE
+#define LOG_SEGMENT_BATCHES (8)
 #define NR_ALLOC_TABLES (1UL << 19)
+#define NR_ALLOC_SPARSE_TABLES (1UL << 19)
 #define NR_NODE_FILL 1024
 #define NR_MMIO_FILL 50
 #define DEFAULT_MMAP_SIZE (1 << 20) /* 1MB */
 #define HYBRID_WRITE_RATIO (40)
 #define SYNC_PERIOD (100)
-#define MAX_SKIP_NODES (2L)
+#define NR_CHECKPOINT_THREADS (2)
+#define AUTO_COMMIT_PERIOD (0)           /* ms, 0 disables */
+#define AUTO_COMMIT_LOG_SIZE (1UL << 30) /* 1GB */
+#define LOG_POOL_LOW_WATERMARK (20)      /* % of free logs */
+#define LOG_POOL_MIN_WATERMARK (5)       /* % of free logs */
+#define POOL_WAIT_RETRIES (10000)
+#define MAGAZINE_SIZE (64)
+#define MAX_DEPOT_MAGAZINES (64)
+#define CACHELINE_SIZE (64)
+#define NR_EPOCH_PINS (16)
+#define BRAVO_READER_SLOTS (32) /* per lock, one cache line each */
+#define BRAVO_REVOKE_SPINS (1000)
+#define TX_MAX_FILES (16)
+#define NR_TX_RECORDS (64) /* at most the bits of a long */
+#define POOL_GROW_BATCHES (2)
+#define NR_RECOVERY_THREADS (8)
+#define OPTIMISTIC_READ_ENTRIES (64) /* 0 disables optimistic reads */
+#define OPTIMISTIC_READ_RETRIES (4)
+#define MAX_NUMA_NODES (8)
 #define HYBRID_LOGGING true
 
 #if 1
@@ -0,0 +1,62 @@
+#ifndef LIBNVMMIO_ENV_H
+#define LIBNVMMIO_ENV_H
+
+#include <stdlib.h>
+
+/*
+ * Read a positive number from the environment variable name.
+ * If the variable is not set or is not valid, default_value is returned.
+ */
+static inline unsigned long get_env_ulong(const char *name,
+                                          unsigned long default_value) {
+  char *env, *end;
+  unsigned long value;
+
+  env = getenv(name);
+  if (env == NULL) {
+    return default_value;
+  }
+
+  value = strtoul(env, &end, 10);
+  if (end == env || *end != '\0') {
+    return default_value;
+  }
+  return value;
+}
+
+/*
+ * Parse a CPU list such as "0-3,8" into cpus[] and return its length.
+ */
+static inline int parse_cpu_list(const char *str, int *cpus, int max) {
+  char *end;
+  long first, last;
+  int n = 0;
+
+  while (*str != '\0' && n < max) {
+    first = strtol(str, &end, 10);
+    if (end == str || first < 0) {
+      break;
+    }
+    last = first;
+    str = end;
+
+    if (*str == '-') {
+      last = strtol(str + 1, &end, 10);
+      if (end == str + 1 || last < first) {
+        break;
+      }
+      str = end;
+    }
+
+    while (first <= last && n < max) {
+      cpus[n++] = first++;
+    }
+
+    if (*str == ',') {
+      str++;
+    }
+  }
+  return n;
+}
+
+#endif /* LIBNVMMIO_ENV_H */
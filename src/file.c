@@ -3,9 +3,13 @@
 #include "file.h"
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 
 #include "allocator.h"
 #include "debug.h"
@@ -20,7 +24,8 @@ file_t *fd_table[MAX_FD] = {
 
 bool initialized = false;
 
-static void libnvmmio_open(int fd, int flags, int mode) {
+static void libnvmmio_open(const char *pathname, int fd, int flags, int mode) {
+  char path[PATH_MAX];
   struct stat statbuf;
   file_t *file;
   mmio_t *mmio;
@@ -45,10 +50,14 @@ static void libnvmmio_open(int fd, int flags, int mode) {
   ino = statbuf.st_ino;
   fsize = statbuf.st_size;
 
+  start_allocator();
   mmio = get_mmio_hash(ino);
 
   if (mmio == NULL) {
-    mmio = get_new_mmio(fd, flags, ino, fsize);
+    if (__glibc_unlikely(realpath(pathname, path) == NULL)) {
+      HANDLE_ERROR("realpath(%s)", pathname);
+    }
+    mmio = get_new_mmio(fd, flags, ino, fsize, path);
     mmio = put_mmio_hash(ino, mmio);
   }
 
@@ -98,6 +107,36 @@ void init_fops(void) {
     HANDLE_ERROR("dlsym(pwrite)");
   }
 
+  posix.readv = dlsym(RTLD_NEXT, "readv");
+  if (__glibc_unlikely(posix.readv == NULL)) {
+    HANDLE_ERROR("dlsym(readv)");
+  }
+
+  posix.writev = dlsym(RTLD_NEXT, "writev");
+  if (__glibc_unlikely(posix.writev == NULL)) {
+    HANDLE_ERROR("dlsym(writev)");
+  }
+
+  posix.preadv = dlsym(RTLD_NEXT, "preadv");
+  if (__glibc_unlikely(posix.preadv == NULL)) {
+    HANDLE_ERROR("dlsym(preadv)");
+  }
+
+  posix.pwritev = dlsym(RTLD_NEXT, "pwritev");
+  if (__glibc_unlikely(posix.pwritev == NULL)) {
+    HANDLE_ERROR("dlsym(pwritev)");
+  }
+
+  posix.preadv2 = dlsym(RTLD_NEXT, "preadv2");
+  if (__glibc_unlikely(posix.preadv2 == NULL)) {
+    HANDLE_ERROR("dlsym(preadv2)");
+  }
+
+  posix.pwritev2 = dlsym(RTLD_NEXT, "pwritev2");
+  if (__glibc_unlikely(posix.pwritev2 == NULL)) {
+    HANDLE_ERROR("dlsym(pwritev2)");
+  }
+
   posix.fsync = dlsym(RTLD_NEXT, "fsync");
   if (__glibc_unlikely(posix.fsync == NULL)) {
     HANDLE_ERROR("dlsym(fsync)");
@@ -134,7 +173,34 @@ void init_fops(void) {
   }
 }
 
-static inline file_t *get_file(int fd) { return fd_table[fd]; }
+static inline file_t *get_file(int fd) {
+  if (__glibc_unlikely(fd < 0 || fd >= MAX_FD)) {
+    return NULL;
+  }
+  return fd_table[fd];
+}
+
+/*
+ * The mmio only takes offsets inside the file, so the arguments that the
+ * kernel would reject are rejected here as well.
+ */
+static inline bool check_io_args(off_t pos, int iovcnt) {
+  if (__glibc_unlikely(pos < 0 || iovcnt < 0 || iovcnt > IOV_MAX)) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Return the inode number of an O_ATOMIC file, or 0 if the fd is not one.
+ */
+unsigned long get_atomic_ino(int fd) {
+  file_t *file;
+
+  file = get_file(fd);
+  return file != NULL ? file->ino : 0;
+}
 
 int open(const char *pathname, int flags, ...) {
   int fd, mode = 0;
@@ -157,7 +223,7 @@ int open(const char *pathname, int flags, ...) {
   PRINT("pathname=%s, flags=%d, fd=%d", pathname, flags, fd);
 
   if (flags & O_ATOMIC) {
-    libnvmmio_open(fd, flags, mode);
+    libnvmmio_open(pathname, fd, flags, mode);
   }
   return fd;
 }
@@ -183,7 +249,7 @@ int open64(const char *pathname, int flags, ...) {
   PRINT("pathname=%s, flags=%d, fd=%d", pathname, flags, fd);
 
   if (flags & O_ATOMIC) {
-    libnvmmio_open(fd, flags, mode);
+    libnvmmio_open(pathname, fd, flags, mode);
   }
   return fd;
 }
@@ -246,7 +312,18 @@ ssize_t write(int fd, const void *buf, size_t len) {
 }
 
 ssize_t pread(int fd, void *buf, size_t count, off_t pos) {
-  PRINT("call");
+  file_t *file;
+
+  PRINT("fd=%d, buf=%p, count=%lu, pos=%ld", fd, buf, count, pos);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (!check_io_args(pos, 1)) {
+      return -1;
+    }
+    return mmio_read(file->mmio, pos, buf, count);
+  }
 
   if (__glibc_unlikely(posix.pread == NULL)) {
     posix.pread = dlsym(RTLD_NEXT, "pread");
@@ -258,8 +335,24 @@ ssize_t pread(int fd, void *buf, size_t count, off_t pos) {
   return posix.pread(fd, buf, count, pos);
 }
 
-ssize_t pwrite(int fd, const void *buf, size_t count, off_t pos) {
+ssize_t pread64(int fd, void *buf, size_t count, off64_t pos) {
   PRINT("call");
+  return pread(fd, buf, count, (off_t)pos);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t pos) {
+  file_t *file;
+
+  PRINT("fd=%d, buf=%p, count=%lu, pos=%ld", fd, buf, count, pos);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (!check_io_args(pos, 1)) {
+      return -1;
+    }
+    return mmio_write(file->mmio, fd, pos, buf, count);
+  }
 
   if (__glibc_unlikely(posix.pwrite == NULL)) {
     posix.pwrite = dlsym(RTLD_NEXT, "pwrite");
@@ -271,6 +364,225 @@ ssize_t pwrite(int fd, const void *buf, size_t count, off_t pos) {
   return posix.pwrite(fd, buf, count, pos);
 }
 
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t pos) {
+  PRINT("call");
+  return pwrite(fd, buf, count, (off_t)pos);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+  file_t *file;
+  ssize_t ret;
+
+  PRINT("fd=%d, iov=%p, iovcnt=%d", fd, iov, iovcnt);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (!check_io_args(0, iovcnt)) {
+      return -1;
+    }
+    MUTEX_LOCK(&file->mutex);
+
+    ret = mmio_readv(file->mmio, file->pos, iov, iovcnt);
+    file->pos += ret;
+
+    MUTEX_UNLOCK(&file->mutex);
+    return ret;
+  }
+
+  if (__glibc_unlikely(posix.readv == NULL)) {
+    posix.readv = dlsym(RTLD_NEXT, "readv");
+    if (__glibc_unlikely(posix.readv == NULL)) {
+      HANDLE_ERROR("dlsym(readv)");
+    }
+  }
+
+  return posix.readv(fd, iov, iovcnt);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  file_t *file;
+  ssize_t ret;
+
+  PRINT("fd=%d, iov=%p, iovcnt=%d", fd, iov, iovcnt);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (!check_io_args(0, iovcnt)) {
+      return -1;
+    }
+    MUTEX_LOCK(&file->mutex);
+
+    ret = mmio_writev(file->mmio, fd, file->pos, iov, iovcnt);
+    file->pos += ret;
+
+    MUTEX_UNLOCK(&file->mutex);
+    return ret;
+  }
+
+  if (__glibc_unlikely(posix.writev == NULL)) {
+    posix.writev = dlsym(RTLD_NEXT, "writev");
+    if (__glibc_unlikely(posix.writev == NULL)) {
+      HANDLE_ERROR("dlsym(writev)");
+    }
+  }
+
+  return posix.writev(fd, iov, iovcnt);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t pos) {
+  file_t *file;
+
+  PRINT("fd=%d, iov=%p, iovcnt=%d, pos=%ld", fd, iov, iovcnt, pos);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (!check_io_args(pos, iovcnt)) {
+      return -1;
+    }
+    return mmio_readv(file->mmio, pos, iov, iovcnt);
+  }
+
+  if (__glibc_unlikely(posix.preadv == NULL)) {
+    posix.preadv = dlsym(RTLD_NEXT, "preadv");
+    if (__glibc_unlikely(posix.preadv == NULL)) {
+      HANDLE_ERROR("dlsym(preadv)");
+    }
+  }
+
+  return posix.preadv(fd, iov, iovcnt, pos);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t pos) {
+  file_t *file;
+
+  PRINT("fd=%d, iov=%p, iovcnt=%d, pos=%ld", fd, iov, iovcnt, pos);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (!check_io_args(pos, iovcnt)) {
+      return -1;
+    }
+    return mmio_writev(file->mmio, fd, pos, iov, iovcnt);
+  }
+
+  if (__glibc_unlikely(posix.pwritev == NULL)) {
+    posix.pwritev = dlsym(RTLD_NEXT, "pwritev");
+    if (__glibc_unlikely(posix.pwritev == NULL)) {
+      HANDLE_ERROR("dlsym(pwritev)");
+    }
+  }
+
+  return posix.pwritev(fd, iov, iovcnt, pos);
+}
+
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off64_t pos) {
+  PRINT("call");
+  return preadv(fd, iov, iovcnt, (off_t)pos);
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt, off64_t pos) {
+  PRINT("call");
+  return pwritev(fd, iov, iovcnt, (off_t)pos);
+}
+
+/*
+ * A position of -1 means the current file position, as with readv().
+ * RWF_HIPRI does not change how the logs are read, so it is ignored.
+ * The other flags are not supported.
+ */
+ssize_t preadv2(int fd, const struct iovec *iov, int iovcnt, off_t pos,
+                int flags) {
+  file_t *file;
+
+  PRINT("fd=%d, iov=%p, iovcnt=%d, pos=%ld, flags=%d", fd, iov, iovcnt, pos,
+        flags);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (__glibc_unlikely(flags & ~RWF_HIPRI)) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+    if (pos == -1) {
+      return readv(fd, iov, iovcnt);
+    }
+    if (!check_io_args(pos, iovcnt)) {
+      return -1;
+    }
+    return mmio_readv(file->mmio, pos, iov, iovcnt);
+  }
+
+  if (__glibc_unlikely(posix.preadv2 == NULL)) {
+    posix.preadv2 = dlsym(RTLD_NEXT, "preadv2");
+    if (__glibc_unlikely(posix.preadv2 == NULL)) {
+      HANDLE_ERROR("dlsym(preadv2)");
+    }
+  }
+
+  return posix.preadv2(fd, iov, iovcnt, pos, flags);
+}
+
+/*
+ * A position of -1 means the current file position, as with writev().
+ * RWF_SYNC and RWF_DSYNC commit the write as fsync() would, and RWF_HIPRI
+ * is ignored. The other flags, such as RWF_APPEND, are not supported.
+ */
+ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t pos,
+                 int flags) {
+  file_t *file;
+  ssize_t ret;
+
+  PRINT("fd=%d, iov=%p, iovcnt=%d, pos=%ld, flags=%d", fd, iov, iovcnt, pos,
+        flags);
+
+  file = get_file(fd);
+
+  if (__glibc_likely(file != NULL)) {
+    if (__glibc_unlikely(flags & ~(RWF_HIPRI | RWF_DSYNC | RWF_SYNC))) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+    if (pos == -1) {
+      ret = writev(fd, iov, iovcnt);
+    } else if (!check_io_args(pos, iovcnt)) {
+      return -1;
+    } else {
+      ret = mmio_writev(file->mmio, fd, pos, iov, iovcnt);
+    }
+
+    if (flags & (RWF_SYNC | RWF_DSYNC)) {
+      fsync(fd);
+    }
+    return ret;
+  }
+
+  if (__glibc_unlikely(posix.pwritev2 == NULL)) {
+    posix.pwritev2 = dlsym(RTLD_NEXT, "pwritev2");
+    if (__glibc_unlikely(posix.pwritev2 == NULL)) {
+      HANDLE_ERROR("dlsym(pwritev2)");
+    }
+  }
+
+  return posix.pwritev2(fd, iov, iovcnt, pos, flags);
+}
+
+ssize_t preadv64v2(int fd, const struct iovec *iov, int iovcnt, off64_t pos,
+                   int flags) {
+  PRINT("call");
+  return preadv2(fd, iov, iovcnt, (off_t)pos, flags);
+}
+
+ssize_t pwritev64v2(int fd, const struct iovec *iov, int iovcnt, off64_t pos,
+                    int flags) {
+  PRINT("call");
+  return pwritev2(fd, iov, iovcnt, (off_t)pos, flags);
+}
+
 int fsync(int fd) {
   file_t *file;
 
@@ -278,9 +590,8 @@ int fsync(int fd) {
 
   file = get_file(fd);
   if (file != NULL) {
-    MUTEX_LOCK(&file->mutex);
+    /* Concurrent fsyncs of the file join a group commit. */
     commit_mmio(file->mmio);
-    MUTEX_UNLOCK(&file->mutex);
     return 0;
   }
 
@@ -418,8 +729,8 @@ int close(int fd) {
 
   PRINT("fd=%d", fd);
 
-  if (fd_table[fd] != NULL) {
-    file = fd_table[fd];
+  file = get_file(fd);
+  if (file != NULL) {
     MUTEX_LOCK(&file->mutex);
     delete_mmio_hash(fd, file);
     MUTEX_UNLOCK(&file->mutex);
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "mmio.h"
@@ -17,6 +18,8 @@ typedef struct file_struct {
   pthread_mutex_t mutex;
 } file_t;
 
+unsigned long get_atomic_ino(int fd);
+
 struct fops_struct {
   int (*open)(const char *pathname, int flags, ...);
   int (*open64)(const char *pathname, int flags, ...);
@@ -24,6 +27,14 @@ struct fops_struct {
   ssize_t (*write)(int fd, const void *buf, size_t count);
   ssize_t (*pread)(int fd, void *buf, size_t count, off_t pos);
   ssize_t (*pwrite)(int fd, const void *buf, size_t count, off_t pos);
+  ssize_t (*readv)(int fd, const struct iovec *iov, int iovcnt);
+  ssize_t (*writev)(int fd, const struct iovec *iov, int iovcnt);
+  ssize_t (*preadv)(int fd, const struct iovec *iov, int iovcnt, off_t pos);
+  ssize_t (*pwritev)(int fd, const struct iovec *iov, int iovcnt, off_t pos);
+  ssize_t (*preadv2)(int fd, const struct iovec *iov, int iovcnt, off_t pos,
+                     int flags);
+  ssize_t (*pwritev2)(int fd, const struct iovec *iov, int iovcnt, off_t pos,
+                      int flags);
   int (*fsync)(int fd);
   off_t (*lseek)(int fd, off_t offset, int whence);
   int (*truncate)(const char *path, off_t length);
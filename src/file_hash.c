@@ -2,9 +2,12 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "allocator.h"
+#include "autocommit.h"
+#include "checkpoint.h"
 #include "config.h"
 #include "debug.h"
 #include "list.h"
@@ -113,7 +116,16 @@ void delete_mmio_hash(int fd, file_t *file) {
         mmio->ref--;
 
         if (mmio->ref <= 0) {
-          checkpoint_mmio(mmio);
+          /*
+           * Stop the committer and the checkpoint workers first, then
+           * commit and write back every entry, so that no live log entry
+           * refers to the mmio once it is released. A REDO entry that is
+           * left in the log would otherwise be lost.
+           */
+          unregister_autocommit(mmio);
+          cancel_checkpoint(mmio);
+          commit_mmio(mmio);
+          drain_mmio(mmio);
           list_del(&hnode->list);
           free(hnode);
           release_mmio(mmio, file->flags, fd);
@@ -125,6 +137,100 @@ void delete_mmio_hash(int fd, file_t *file) {
   MUTEX_UNLOCK(&file_hash[index].mutex);
 }
 
+static int compare_hash_indexes(const void *a, const void *b) {
+  return get_hash_index(*(unsigned long *)a) -
+         get_hash_index(*(unsigned long *)b);
+}
+
+static mmio_t *find_mmio_hash(int index, unsigned long ino) {
+  hash_node_t *node;
+  mmio_t *mmio;
+
+  LIST_FOR_EACH_ENTRY(node, &file_hash[index].head, list) {
+    mmio = (mmio_t *)node->ptr;
+    if (ino == mmio->ino) {
+      return mmio;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Find the mmios of the inodes and keep their lists locked until
+ * unlock_mmio_hashes(), so that none of them can be released meanwhile.
+ * The inodes are sorted in the order of their lists, which are locked in
+ * that order, and mmios[i] is the mmio of inos[i]. If a file is no longer
+ * open, nothing is left locked and false is returned.
+ */
+bool lock_mmio_hashes(unsigned long *inos, int nr, mmio_t **mmios) {
+  int i, index, prev = -1;
+
+  qsort(inos, nr, sizeof(unsigned long), compare_hash_indexes);
+
+  for (i = 0; i < nr; i++) {
+    index = get_hash_index(inos[i]);
+    if (index != prev) {
+      MUTEX_LOCK(&file_hash[index].mutex);
+      prev = index;
+    }
+
+    mmios[i] = find_mmio_hash(index, inos[i]);
+    if (mmios[i] == NULL) {
+      unlock_mmio_hashes(inos, i + 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+void unlock_mmio_hashes(unsigned long *inos, int nr) {
+  int i, index, prev = -1;
+
+  for (i = 0; i < nr; i++) {
+    index = get_hash_index(inos[i]);
+    if (index != prev) {
+      MUTEX_UNLOCK(&file_hash[index].mutex);
+      prev = index;
+    }
+  }
+}
+
+/*
+ * An open transaction holds the mmio of each of its files, so that the
+ * committer leaves them to the transaction. A hold is only dropped from
+ * the mmio it was taken on, which the generation of its log tells apart
+ * from a later mmio of the same file. Return the generation, or 0 if the
+ * file is not open.
+ */
+unsigned long hold_mmio_hash(unsigned long ino) {
+  unsigned long generation = 0;
+  mmio_t *mmio;
+  int index;
+
+  index = get_hash_index(ino);
+  MUTEX_LOCK(&file_hash[index].mutex);
+  mmio = find_mmio_hash(index, ino);
+  if (mmio != NULL) {
+    __atomic_add_fetch(&mmio->tx_holds, 1, __ATOMIC_RELAXED);
+    generation = mmio->radixlog.generation;
+  }
+  MUTEX_UNLOCK(&file_hash[index].mutex);
+  return generation;
+}
+
+void unhold_mmio_hash(unsigned long ino, unsigned long generation) {
+  mmio_t *mmio;
+  int index;
+
+  index = get_hash_index(ino);
+  MUTEX_LOCK(&file_hash[index].mutex);
+  mmio = find_mmio_hash(index, ino);
+  if (mmio != NULL && mmio->radixlog.generation == generation) {
+    __atomic_sub_fetch(&mmio->tx_holds, 1, __ATOMIC_RELAXED);
+  }
+  MUTEX_UNLOCK(&file_hash[index].mutex);
+}
+
 void init_file_hash(void) {
   int i, s;
 
@@ -8,5 +8,9 @@ void init_file_hash(void);
 mmio_t *get_mmio_hash(unsigned long ino);
 mmio_t *put_mmio_hash(unsigned long ino, mmio_t *mmio);
 void delete_mmio_hash(int fd, file_t *file);
+bool lock_mmio_hashes(unsigned long *inos, int nr, mmio_t **mmios);
+void unlock_mmio_hashes(unsigned long *inos, int nr);
+unsigned long hold_mmio_hash(unsigned long ino);
+void unhold_mmio_hash(unsigned long ino, unsigned long generation);
 
 #endif /* LIBNVMMIO_FILE_HASH_H */
@@ -8,4 +8,26 @@
 
 #define O_ATOMIC 01000000000
 
+/*
+ * Multi-file transactions. nvmmio_tx_commit() commits the O_ATOMIC files
+ * added to the transaction at once, as fsync() commits one file: after a
+ * crash, either all of them hold every write done before the commit, or
+ * all of them are at their previous commits. A transaction commits all
+ * the writes to its files, whichever thread did them, and frees the
+ * transaction. Until then, its files are not committed in the background
+ * (only fsync() and the last close() commit them), and their writers
+ * wait if the logs run short, so every transaction has to be committed.
+ * nvmmio_tx_begin() returns NULL if it is out of memory. The others
+ * return -1 and set errno: nvmmio_tx_add_fd() for an fd that is not an
+ * open O_ATOMIC file (EINVAL) or a transaction that is full (E2BIG), and
+ * nvmmio_tx_commit() for a file closed before the commit (EBADF) or too
+ * many transactions committing at once (EAGAIN), in which case nothing
+ * is committed.
+ */
+typedef struct nvmmio_tx_struct nvmmio_tx_t;
+
+nvmmio_tx_t *nvmmio_tx_begin(void);
+int nvmmio_tx_add_fd(nvmmio_tx_t *tx, int fd);
+int nvmmio_tx_commit(nvmmio_tx_t *tx);
+
 #endif /* LIBNVMMIO_H */
@@ -1,7 +1,12 @@
 #ifndef LIBNVMMIO_LOCK_H
 #define LIBNVMMIO_LOCK_H
 
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "debug.h"
 
@@ -19,43 +24,180 @@
     }                                                           \
   } while (0)
 
-#define RWLOCK_INIT(rwlockp_)                                         \
-  do {                                                                \
-    if (__glibc_unlikely(pthread_rwlock_init(rwlockp_, NULL) != 0)) { \
-      HANDLE_ERROR("pthread_rwlock_init");                            \
-    }                                                                 \
-  } while (0)
+/*
+ * A compact reader/writer lock embedded in each index entry.
+ *
+ * The low half of the word is the lock state: the writer, waiters and
+ * freed bits, and the number of readers. Waiters spin for a while and
+ * then park on it with futex(2). The high half is a version bumped by
+ * every writer, so that readers can also go without the lock and
+ * validate what they read afterwards.
+ */
+#define VLOCK_WRITER (1U)
+#define VLOCK_WAITERS (2U)
+#define VLOCK_FREED (4U)
+#define VLOCK_READER (8U)
+#define VLOCK_VERSION_SHIFT (32)
+#define VLOCK_SPINS (8) /* backoff rounds of 1, 2, 4, ... pauses */
 
-#define RWLOCK_DESTROY(rwlockp_)                                   \
-  do {                                                             \
-    if (__glibc_unlikely(pthread_rwlock_destroy(rwlockp_) != 0)) { \
-      HANDLE_ERROR("pthread_rwlock_destroy");                      \
-    }                                                              \
-  } while (0)
+typedef union vlock_union {
+  unsigned long word;
+  struct {
+    unsigned int state; /* little-endian: the low half of word */
+    unsigned int version;
+  };
+} vlock_t;
 
-#define RWLOCK_READ_LOCK(rwlockp_)                                \
-  do {                                                            \
-    if (__glibc_unlikely(pthread_rwlock_rdlock(rwlockp_) != 0)) { \
-      HANDLE_ERROR("pthread_rwlock_rdlock");                      \
-    }                                                             \
-  } while (0)
+static inline void vlock_futex_wake(vlock_t *lock) {
+  syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
 
-#define RWLOCK_READ_TRYLOCK(rwlockp_) (pthread_rwlock_tryrdlock(rwlockp_) == 0)
+/*
+ * The version is kept across reuses of the entry.
+ */
+static inline void vlock_init(vlock_t *lock) {
+  __atomic_store_n(&lock->state, 0, __ATOMIC_RELEASE);
+}
 
-#define RWLOCK_WRITE_LOCK(rwlockp_)                               \
-  do {                                                            \
-    if (__glibc_unlikely(pthread_rwlock_wrlock(rwlockp_) != 0)) { \
-      HANDLE_ERROR("pthread_rwlock_wrlock");                      \
-    }                                                             \
-  } while (0)
+static inline bool vlock_tryrdlock(vlock_t *lock) {
+  unsigned int old;
 
-#define RWLOCK_WRITE_TRYLOCK(rwlockp_) (pthread_rwlock_trywrlock(rwlockp_) == 0)
+  old = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+  while (!(old & VLOCK_WRITER)) {
+    if (__atomic_compare_exchange_n(&lock->state, &old, old + VLOCK_READER,
+                                    true, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
 
-#define RWLOCK_UNLOCK(rwlockp_)                                   \
-  do {                                                            \
-    if (__glibc_unlikely(pthread_rwlock_unlock(rwlockp_) != 0)) { \
-      HANDLE_ERROR("pthread_rwlock_unlock");                      \
-    }                                                             \
-  } while (0)
+static inline bool vlock_trywrlock(vlock_t *lock) {
+  unsigned int old;
+
+  old = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+  while (!(old & ~VLOCK_WAITERS)) {
+    if (__atomic_compare_exchange_n(&lock->state, &old, old | VLOCK_WRITER,
+                                    true, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Replace the state of a write-locked word and bump its version.
+ */
+static inline void vlock_release(vlock_t *lock, unsigned int state) {
+  unsigned long old, new;
+
+  old = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+  do {
+    new = (((old >> VLOCK_VERSION_SHIFT) + 1) << VLOCK_VERSION_SHIFT) | state;
+  } while (!__atomic_compare_exchange_n(&lock->word, &old, new, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (old & VLOCK_WAITERS) {
+    vlock_futex_wake(lock);
+  }
+}
+
+static inline void vlock_unlock(vlock_t *lock) {
+  unsigned int state;
+
+  if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) & VLOCK_WRITER) {
+    vlock_release(lock, 0);
+    return;
+  }
+
+  state = __atomic_sub_fetch(&lock->state, VLOCK_READER, __ATOMIC_RELEASE);
+  if (__glibc_unlikely(state == VLOCK_WAITERS) &&
+      __atomic_compare_exchange_n(&lock->state, &state, 0, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    vlock_futex_wake(lock);
+  }
+}
+
+/*
+ * Called by the writer before the entry goes back to its pool. The lock
+ * stays held, so that threads which still see the entry give up on it,
+ * and its waiters are woken up to look the entry up again.
+ */
+static inline void vlock_invalidate(vlock_t *lock) {
+  vlock_release(lock, VLOCK_WRITER | VLOCK_FREED);
+}
+
+/*
+ * Take a freed lock back as a writer, for a new use of its entry that
+ * does not go through the pool. Only one of the threads racing for it
+ * gets it.
+ */
+static inline bool vlock_tryclaim(vlock_t *lock) {
+  unsigned int old = VLOCK_WRITER | VLOCK_FREED;
+
+  return __atomic_compare_exchange_n(&lock->state, &old, VLOCK_WRITER, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wait until the state has none of the busy bits. The caller retries
+ * its trylock afterwards, which may fail again. The first VLOCK_SPINS
+ * retries back off exponentially, and the later ones park.
+ */
+static inline void __vlock_wait(vlock_t *lock, unsigned int busy, int spins) {
+  unsigned int old;
+  int i;
+
+  if (spins < VLOCK_SPINS) {
+    for (i = 0; i < (1 << spins); i++) {
+      __builtin_ia32_pause();
+    }
+    return;
+  }
+
+  old = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+  if (!(old & busy) || (old & VLOCK_FREED)) {
+    return;
+  }
+
+  if (!(old & VLOCK_WAITERS)) {
+    if (!__atomic_compare_exchange_n(&lock->state, &old, old | VLOCK_WAITERS,
+                                     false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+      return;
+    }
+    old |= VLOCK_WAITERS;
+  }
+
+  syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
+}
+
+/*
+ * Optimistic readers take a snapshot of the word before they read and
+ * check it afterwards. Reading is only worth it if no writer holds the
+ * lock, and it has to be retried if a writer came in the meantime.
+ */
+static inline unsigned long vlock_read_begin(vlock_t *lock) {
+  return __atomic_load_n(&lock->word, __ATOMIC_ACQUIRE);
+}
+
+static inline bool vlock_read_busy(unsigned long word) {
+  return word & VLOCK_WRITER;
+}
+
+static inline bool vlock_read_retry(vlock_t *lock, unsigned long word) {
+  unsigned long now;
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  now = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+  return (now & VLOCK_WRITER) ||
+         (now >> VLOCK_VERSION_SHIFT) != (word >> VLOCK_VERSION_SHIFT);
+}
+
+#define vlock_wait_rd(lock_, spins_) __vlock_wait(lock_, VLOCK_WRITER, spins_)
+#define vlock_wait_wr(lock_, spins_) \
+  __vlock_wait(lock_, ~VLOCK_WAITERS, spins_)
 
 #endif /* LIBNVMMIO_LOCK_H */
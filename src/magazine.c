@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include "magazine.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+#include "allocator.h"
+#include "config.h"
+#include "debug.h"
+
+/*
+ * A magazine layer on top of the global free lists, as in
+ *
+ * Magazines and Vmem: Extending the Slab Allocator to Many CPUs and
+ * Arbitrary Resources (USENIX ATC '01)
+ *
+ * Each CPU caches two magazines of objects. Allocations and frees
+ * only touch the cache of the current CPU, whose lock is uncontended
+ * unless a thread is preempted in it. Full and empty magazines are
+ * exchanged with the depot through lock-free Treiber stacks. The top
+ * of a stack carries a tag in its upper bits against ABA, and
+ * magazines are never freed, so a popped magazine can always be read.
+ * Only an empty depot falls back to the global list and its mutex.
+ */
+
+#define TAG_SHIFT (48)
+#define TAG_PTR(top_) ((magazine_t *)((top_) & ((1UL << TAG_SHIFT) - 1)))
+#define TAG_NEXT(top_, ptr_) \
+  ((unsigned long)(ptr_) | ((((top_) >> TAG_SHIFT) + 1) << TAG_SHIFT))
+
+#define CACHE_LOCK_SPINS (128)
+
+static int nr_cpus = 0;
+
+static void push_magazine(unsigned long *top, magazine_t *mag) {
+  unsigned long old;
+
+  do {
+    old = *top;
+    mag->next = TAG_PTR(old);
+  } while (!__sync_bool_compare_and_swap(top, old, TAG_NEXT(old, mag)));
+}
+
+static magazine_t *pop_magazine(unsigned long *top) {
+  magazine_t *mag;
+  unsigned long old;
+
+  do {
+    old = *top;
+    mag = TAG_PTR(old);
+    if (mag == NULL) {
+      return NULL;
+    }
+  } while (!__sync_bool_compare_and_swap(top, old, TAG_NEXT(old, mag->next)));
+
+  return mag;
+}
+
+static magazine_t *new_magazine(depot_t *depot) {
+  magazine_t *mag;
+
+  mag = pop_magazine(&depot->empty);
+  if (mag == NULL) {
+    mag = (magazine_t *)malloc(sizeof(magazine_t) +
+                               depot->size * sizeof(void *));
+    if (__glibc_unlikely(mag == NULL)) {
+      HANDLE_ERROR("malloc");
+    }
+  }
+  mag->rounds = 0;
+  return mag;
+}
+
+/*
+ * The depot keeps at most MAX_DEPOT_MAGAZINES full magazines.
+ * The rest goes back to the global list, where it can be reused
+ * or released by the pool.
+ */
+static void push_full_magazine(depot_t *depot, magazine_t *mag) {
+  if (depot->nr_full >= MAX_DEPOT_MAGAZINES) {
+    put_global_objs(depot->global, mag->objs, mag->rounds);
+    mag->rounds = 0;
+    push_magazine(&depot->empty, mag);
+    return;
+  }
+  push_magazine(&depot->full, mag);
+  __sync_fetch_and_add(&depot->nr_full, 1);
+}
+
+static inline cpu_cache_t *lock_cpu_cache(depot_t *depot) {
+  cpu_cache_t *cache;
+  int cpu, spins;
+
+  cpu = sched_getcpu();
+  if (__glibc_unlikely(cpu < 0)) {
+    cpu = 0;
+  }
+  cache = &depot->caches[cpu % nr_cpus];
+
+  /*
+   * The holder may have been preempted on this CPU, so do not spin long.
+   */
+  while (__sync_lock_test_and_set(&cache->lock, 1)) {
+    for (spins = 0; cache->lock; spins++) {
+      if (spins < CACHE_LOCK_SPINS) {
+        __builtin_ia32_pause();
+      } else {
+        sched_yield();
+      }
+    }
+  }
+
+  if (__glibc_unlikely(cache->loaded == NULL)) {
+    cache->loaded = new_magazine(depot);
+    cache->previous = new_magazine(depot);
+  }
+  return cache;
+}
+
+static inline void unlock_cpu_cache(cpu_cache_t *cache) {
+  __sync_lock_release(&cache->lock);
+}
+
+depot_t *create_depot(flist_t *global, unsigned long capacity) {
+  depot_t *depot;
+  int s;
+
+  if (nr_cpus == 0) {
+    nr_cpus = get_nprocs_conf();
+  }
+
+  depot = (depot_t *)malloc(sizeof(depot_t));
+  if (__glibc_unlikely(depot == NULL)) {
+    HANDLE_ERROR("malloc");
+  }
+
+  s = posix_memalign((void **)&depot->caches, CACHELINE_SIZE,
+                     nr_cpus * sizeof(cpu_cache_t));
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("posix_memalign");
+  }
+  memset(depot->caches, 0, nr_cpus * sizeof(cpu_cache_t));
+
+  /*
+   * Small pools must not be used up by the caches of idle CPUs.
+   */
+  depot->size = capacity / (nr_cpus * 4);
+  if (depot->size > MAGAZINE_SIZE) {
+    depot->size = MAGAZINE_SIZE;
+  } else if (depot->size == 0) {
+    depot->size = 1;
+  }
+
+  depot->full = 0;
+  depot->empty = 0;
+  depot->nr_full = 0;
+  depot->global = global;
+
+  PRINT("magazine size: %lu, cpus: %d", depot->size, nr_cpus);
+  return depot;
+}
+
+static void *__magazine_alloc(depot_t *depot, bool wait) {
+  cpu_cache_t *cache;
+  magazine_t *mag;
+  void *obj;
+
+  cache = lock_cpu_cache(depot);
+
+  while (__glibc_unlikely(cache->loaded->rounds == 0)) {
+    if (cache->previous->rounds > 0) {
+      mag = cache->loaded;
+      cache->loaded = cache->previous;
+      cache->previous = mag;
+      continue;
+    }
+
+    mag = pop_magazine(&depot->full);
+    if (mag != NULL) {
+      __sync_fetch_and_sub(&depot->nr_full, 1);
+      push_magazine(&depot->empty, cache->previous);
+      cache->previous = cache->loaded;
+      cache->loaded = mag;
+      continue;
+    }
+
+    /*
+     * The depot is empty. Filling a magazine from the global list may
+     * have to wait for free objects, so the cache is released meanwhile.
+     */
+    unlock_cpu_cache(cache);
+
+    mag = new_magazine(depot);
+    mag->rounds = get_global(depot->global, mag->objs, depot->size, wait);
+
+    cache = lock_cpu_cache(depot);
+
+    if (mag->rounds == 0) {
+      push_magazine(&depot->empty, mag);
+      if (cache->loaded->rounds == 0 && cache->previous->rounds == 0) {
+        unlock_cpu_cache(cache);
+        return NULL;
+      }
+      continue;
+    }
+
+    if (cache->loaded->rounds == 0) {
+      push_magazine(&depot->empty, cache->loaded);
+      cache->loaded = mag;
+    } else {
+      push_full_magazine(depot, mag);
+    }
+  }
+
+  obj = cache->loaded->objs[--cache->loaded->rounds];
+  cache->allocs++;
+  unlock_cpu_cache(cache);
+
+  return obj;
+}
+
+void *magazine_alloc(depot_t *depot) { return __magazine_alloc(depot, true); }
+
+/*
+ * Same as magazine_alloc(), but return NULL instead of waiting
+ * if the pool is exhausted.
+ */
+void *magazine_try_alloc(depot_t *depot) {
+  return __magazine_alloc(depot, false);
+}
+
+void magazine_free(depot_t *depot, void *obj) {
+  cpu_cache_t *cache;
+  magazine_t *mag;
+
+  cache = lock_cpu_cache(depot);
+
+  while (__glibc_unlikely(cache->loaded->rounds == depot->size)) {
+    if (cache->previous->rounds == 0) {
+      mag = cache->loaded;
+      cache->loaded = cache->previous;
+      cache->previous = mag;
+      continue;
+    }
+
+    push_full_magazine(depot, cache->previous);
+    cache->previous = cache->loaded;
+    cache->loaded = new_magazine(depot);
+  }
+
+  cache->loaded->objs[cache->loaded->rounds++] = obj;
+  cache->frees++;
+  unlock_cpu_cache(cache);
+}
+
+/*
+ * Return the objects of all full magazines to the global list.
+ */
+void drain_depot(depot_t *depot) {
+  magazine_t *mag;
+
+  while ((mag = pop_magazine(&depot->full)) != NULL) {
+    __sync_fetch_and_sub(&depot->nr_full, 1);
+    put_global_objs(depot->global, mag->objs, mag->rounds);
+    mag->rounds = 0;
+    push_magazine(&depot->empty, mag);
+  }
+}
+
+/*
+ * Add up the objects allocated and freed through the depot. The counters
+ * are read without the locks, so the sums are only a snapshot.
+ */
+void get_depot_stats(depot_t *depot, unsigned long *allocs,
+                     unsigned long *frees) {
+  int i;
+
+  for (i = 0; i < nr_cpus; i++) {
+    *allocs += depot->caches[i].allocs;
+    *frees += depot->caches[i].frees;
+  }
+}
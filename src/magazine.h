@@ -0,0 +1,42 @@
+#ifndef LIBNVMMIO_MAGAZINE_H
+#define LIBNVMMIO_MAGAZINE_H
+
+#include "allocator.h"
+#include "config.h"
+
+typedef struct magazine_struct {
+  struct magazine_struct *next;
+  unsigned long rounds;
+  void *objs[];
+} magazine_t;
+
+typedef struct cpu_cache_struct {
+  volatile int lock;
+  magazine_t *loaded;
+  magazine_t *previous;
+  unsigned long allocs; /* usage counters, under the lock */
+  unsigned long frees;
+} __attribute__((aligned(CACHELINE_SIZE))) cpu_cache_t;
+
+typedef struct depot_struct {
+  unsigned long full;  /* tagged top of the full magazines */
+  unsigned long empty; /* tagged top of the empty magazines */
+  unsigned long nr_full;
+  unsigned long size; /* rounds per magazine */
+  flist_t *global;
+  cpu_cache_t *caches;
+} depot_t;
+
+depot_t *create_depot(flist_t *global, unsigned long capacity);
+void *magazine_alloc(depot_t *depot);
+void *magazine_try_alloc(depot_t *depot);
+void magazine_free(depot_t *depot, void *obj);
+void drain_depot(depot_t *depot);
+void get_depot_stats(depot_t *depot, unsigned long *allocs,
+                     unsigned long *frees);
+
+static inline unsigned long depot_free_cnt(depot_t *depot) {
+  return depot ? depot->nr_full * depot->size : 0;
+}
+
+#endif /* LIBNVMMIO_MAGAZINE_H */
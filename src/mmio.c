@@ -2,58 +2,25 @@
 #include "mmio.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "allocator.h"
+#include "autocommit.h"
+#include "checkpoint.h"
 #include "config.h"
 #include "debug.h"
 #include "lock.h"
 
-#define LOCK_ENTRIES(type_, mmio_, offset_, len_, entries_head_)         \
-  do {                                                                   \
-    log_table_t *table_;                                                 \
-    idx_entry_t *entry_;                                                 \
-    log_size_t log_size_;                                                \
-    unsigned long index_, log_offset_, log_len_;                         \
-    int n_ = len_;                                                       \
-    unsigned long off_ = offset_;                                        \
-                                                                         \
-    while (n_ > 0) {                                                     \
-      table_ = get_log_table(&mmio_->radixlog, off_);                    \
-      log_size_ = get_log_size(table_, off_, n_);                        \
-      PRINT("log_size=%lu", LOG_SIZE(log_size_));                        \
-      index_ = TABLE_INDEX(log_size_, off_);                             \
-      PRINT("TABLE index=%lu", index_);                                  \
-                                                                         \
-      do {                                                               \
-        entry_ = get_log_entry(mmio_->epoch, table_, index_, log_size_); \
-      } while (pthread_rwlock_try##type_##lock(entry_->rwlockp) != 0);   \
-                                                                         \
-      PRINT(#type_ "lock idx_entry, offset=%lu", offset_);               \
-                                                                         \
-      entry_->log_size = log_size_;                                      \
-      slist_push(&entry_->list, &entries_head_);                         \
-                                                                         \
-      log_offset_ = off_ & (LOG_SIZE(log_size_) - 1);                    \
-      log_len_ = LOG_SIZE(log_size_) - log_offset_;                      \
-      n_ -= log_len_;                                                    \
-      off_ += log_len_;                                                  \
-    }                                                                    \
-  } while (0)
-
-#define UNLOCK_ENTRIES(entries_head_)                    \
-  do {                                                   \
-    idx_entry_t *entry_;                                 \
-    SLIST_FOR_EACH_ENTRY(entry_, &entries_head_, list) { \
-      RWLOCK_UNLOCK(entry_->rwlockp);                    \
-      PRINT("unlock idx_entry");                         \
-    }                                                    \
-  } while (0)
+#define LOCAL_READ_ENTRIES (64)
 
 static inline bool check_expend(mmio_t *mmio, off_t offset, size_t len) {
   if (mmio->end < (mmio->start + offset + len)) {
@@ -112,6 +79,7 @@ static void expend_mmio(mmio_t *mmio, int fd, off_t offset, size_t len) {
     }
     mmio->end = mmio->start + new_len;
   }
+  grow_radixlog(&mmio->radixlog, mmio->end - mmio->start - 1);
   PRINT("expend memory-mapped file: %lu", current_len);
 
   bravo_write_unlock(&mmio->rwlock);
@@ -170,87 +138,143 @@ static inline int check_log(void *req_start, void *req_end, void *log_start,
   }
 }
 
-void checkpoint_mmio(mmio_t *mmio) {
-  log_table_t *table;
+/*
+ * Checkpoint the entries of the old epochs and return the number of
+ * entries (or tables) that were skipped because they were busy.
+ * If locked is true, the caller already holds the lock of the mmio.
+ *
+ * Only the tables in the dirty list, and only the entries set in their
+ * dirty maps, are visited, so the cost scales with the logged blocks.
+ */
+static unsigned long __checkpoint_mmio(mmio_t *mmio, bool locked) {
+  log_table_t *table, *tables;
   idx_entry_t *entry;
   log_size_t log_size;
-  void *dst, *src;
-  unsigned long i, current_epoch, offset, endoff;
+  void *dst, *src, **slot;
+  unsigned long i, w, bits, current_epoch, pending = 0;
+  bool remain;
 
   PRINT("start checkpointing: mmio->ino=%lu", mmio->ino);
 
-  offset = 0;
-  endoff = mmio->end - mmio->start;
   current_epoch = mmio->epoch;
 
-  while (offset < endoff) {
-    log_size = LOG_4K;
-    if (bravo_read_trylock(&mmio->rwlock) == 0) {
-      table = find_log_table(&mmio->radixlog, offset);
-      if (table) {
-        log_size = table->log_size;
-        for (i = 0; i < NR_ENTRIES(log_size); i++) {
-          entry = table->entries[i];
-
-          if (entry && entry->epoch < current_epoch) {
-            if (RWLOCK_WRITE_TRYLOCK(entry->rwlockp)) {
-              if (entry->epoch < current_epoch) {
-                if (entry->policy == REDO) {
-                  dst = entry->dst + entry->offset;
-                  src = entry->log + entry->offset;
-                  NTSTORE(dst, src, entry->len);
-                  PRINT("ntstore(%p, %p, %u)", dst, src, entry->len);
-                  FENCE();
-                  PRINT("mfence()");
-                }
-                table->entries[i] = NULL;
-                free_idx_entry(entry, log_size);
-                PRINT("clear the idx_entry: offset=%lu, table idx=%lu", offset,
-                      i);
-                continue;
+  /*
+   * The popped tables are out of the dirty list until they are pushed
+   * back, which determine_policy() has to know.
+   */
+  if (!locked) {
+    __atomic_add_fetch(&mmio->checkpointers, 1, __ATOMIC_SEQ_CST);
+  }
+  tables = pop_dirty_tables(&mmio->radixlog);
+
+  while (tables) {
+    table = tables;
+    tables = table->dirty_next;
+
+    table->dirty = 0;
+    __sync_synchronize();
+
+    if (!locked && bravo_read_trylock(&mmio->rwlock) != 0) {
+      push_dirty_table(&mmio->radixlog, table);
+      pending++;
+      continue;
+    }
+
+    log_size = table->log_size;
+    remain = false;
+
+    for (w = 0; w < dirty_map_len(table); w++) {
+      bits = table->dirty_map[w];
+
+      while (bits) {
+        i = w * BITS_PER_LONG + __builtin_ctzl(bits);
+        bits &= bits - 1;
+        slot = get_dirty_slot(table, i);
+        entry = *slot;
+
+        if (entry == NULL) {
+          continue;
+        }
+
+        if (entry->epoch < current_epoch) {
+          if (vlock_trywrlock(&entry->lock)) {
+            if (entry->epoch < current_epoch) {
+              if (entry->policy == REDO) {
+                dst = mmio->start + entry->dst + entry->offset;
+                src = entry->log + entry->offset;
+                NTSTORE(dst, src, entry->len);
+                PRINT("ntstore(%p, %p, %u)", dst, src, entry->len);
+                FENCE();
+                PRINT("mfence()");
               }
-              RWLOCK_UNLOCK(entry->rwlockp);
+              clear_dirty_entry(table, i);
+              *slot = NULL;
+              free_log_entry(table, entry, log_size);
+              PRINT("clear the idx_entry: table idx=%lu", i);
+              continue;
             }
+            vlock_unlock(&entry->lock);
+          } else {
+            pending++;
           }
         }
+        remain = true;
       }
+    }
+
+    if (!locked) {
       bravo_read_unlock(&mmio->rwlock);
     }
-    offset += NR_ENTRIES(log_size) * LOG_SIZE(log_size);
+
+    /* Entries of the current epoch are checkpointed next time. */
+    if (remain) {
+      push_dirty_table(&mmio->radixlog, table);
+    }
+  }
+
+  if (!locked) {
+    __atomic_sub_fetch(&mmio->checkpointers, 1, __ATOMIC_SEQ_CST);
   }
-  PRINT("complete checkpointing mmio->ino=%lu", mmio->ino);
+  PRINT("complete checkpointing mmio->ino=%lu, pending=%lu", mmio->ino,
+        pending);
+  return pending;
 }
 
-static void *checkpoint_thread_func(void *parm) {
-  mmio_t *mmio;
-  mmio = (mmio_t *)parm;
+unsigned long checkpoint_mmio(mmio_t *mmio) {
+  return __checkpoint_mmio(mmio, false);
+}
 
-  while (true) {
-    usleep((useconds_t)SYNC_PERIOD);
-    PRINT("wake up");
-    checkpoint_mmio(mmio);
+/*
+ * Write back and free every log entry of an mmio that is being released.
+ * The caller has committed it, and nobody else may use it any more, so
+ * the loop ends once the entries that were busy have been freed.
+ */
+void drain_mmio(mmio_t *mmio) {
+  bravo_write_lock(&mmio->rwlock);
+  while (__checkpoint_mmio(mmio, true) > 0) {
+    sched_yield();
   }
-
-  return NULL;
+  bravo_write_unlock(&mmio->rwlock);
 }
 
-void create_checkpoint_thread(mmio_t *mmio) {
-  int s;
+/*
+ * Copy the fields of a log entry that recovery needs to its record, and
+ * return the record so that the caller can flush it.
+ */
+static inline idx_record_t *update_idx_record(idx_entry_t *entry) {
+  idx_record_t *record = entry->record;
 
-  s = pthread_create(&mmio->checkpoint_thread, NULL, checkpoint_thread_func,
-                     mmio);
-  if (__glibc_unlikely(s != 0)) {
-    HANDLE_ERROR("pthread_create");
-  }
-  PRINT("create checkpoint thread: %lu",
-        (unsigned long)mmio->checkpoint_thread);
+  record->dst = entry->dst;
+  record->mmio_id = entry->mmio_id;
+  record->united = entry->united;
+  return record;
 }
 
 inline static void checkpoint_entry(mmio_t *mmio, idx_entry_t *entry) {
   void *dst, *src;
 
   if (entry->policy == REDO) {
-    dst = entry->dst + entry->offset;
+    dst = mmio->start + entry->dst + entry->offset;
     src = entry->log + entry->offset;
     NTSTORE(dst, src, entry->len);
     FENCE();
@@ -259,46 +283,167 @@ inline static void checkpoint_entry(mmio_t *mmio, idx_entry_t *entry) {
   entry->policy = mmio->policy;
   entry->len = 0;
   entry->offset = 0;
-  FLUSH(entry, sizeof(idx_entry_t));
+  FLUSH(update_idx_record(entry), sizeof(idx_record_t));
   FENCE();
 }
 
-ssize_t mmio_write(mmio_t *mmio, int fd, off_t offset, const void *buf,
-                   off_t len) {
-  idx_entry_t *entry;
-  unsigned long log_offset, log_len;
-  void *log_start, *dst, *src;
-  off_t off;
-  off_t ret = 0;
-  log_size_t log_size;
-  int n;
-  SLIST_HEAD(entries_head);
+static inline size_t iov_length(const struct iovec *iov, int iovcnt) {
+  size_t len = 0;
+  int i;
 
-  PRINT("mmio=%p, offset=%ld, buf=%p, len=%ld", mmio, offset, buf, len);
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  return len;
+}
 
-  /*
-   * Acquire the reader-locks of the mmio.
-   */
-  bravo_read_lock(&mmio->rwlock);
+static inline void init_iov_iter(iov_iter_t *iter, const struct iovec *iov,
+                                 int iovcnt) {
+  iter->iov = iov;
+  iter->iovcnt = iovcnt;
+  iter->iov_offset = 0;
+}
 
-  if (__glibc_unlikely(check_expend(mmio, offset, len))) {
-    expend_mmio(mmio, fd, offset, len);
+static inline void advance_iov_iter(iov_iter_t *iter, size_t n) {
+  iter->iov_offset += n;
+
+  while (iter->iovcnt > 0 && iter->iov_offset == iter->iov->iov_len) {
+    iter->iov++;
+    iter->iovcnt--;
+    iter->iov_offset = 0;
   }
+}
 
-  /*
-   * Acquire all writer-locks of required logs.
-   */
-  LOCK_ENTRIES(wr, mmio, offset, len, entries_head);
+/*
+ * Copy n bytes from the user buffers to dst using non-temporal stores.
+ */
+static inline void ntstore_from_iter(void *dst, iov_iter_t *iter, size_t n) {
+  void *src;
+  size_t len;
+
+  while (n > 0) {
+    src = iter->iov->iov_base + iter->iov_offset;
+    len = iter->iov->iov_len - iter->iov_offset;
+
+    if (len > n) {
+      len = n;
+    }
+
+    NTSTORE(dst, src, len);
+    advance_iov_iter(iter, len);
+    dst += len;
+    n -= len;
+  }
+}
+
+/*
+ * Copy n bytes from src to the user buffers.
+ */
+static inline void memcpy_to_iter(iov_iter_t *iter, const void *src,
+                                  size_t n) {
+  void *dst;
+  size_t len;
+
+  while (n > 0) {
+    dst = iter->iov->iov_base + iter->iov_offset;
+    len = iter->iov->iov_len - iter->iov_offset;
+
+    if (len > n) {
+      len = n;
+    }
+
+    memcpy(dst, src, len);
+    advance_iov_iter(iter, len);
+    src += len;
+    n -= len;
+  }
+}
+
+static unsigned int next_pin_slot;
+static __thread unsigned int pin_slot = UINT_MAX;
+
+/*
+ * Pin the epoch of the mmio for a write. The epoch cannot advance until
+ * the write unpins it, and a writer that comes while a commit is in
+ * progress waits for the new epoch.
+ */
+static inline epoch_pin_t *pin_epoch(mmio_t *mmio) {
+  epoch_pin_t *pin;
+
+  if (__glibc_unlikely(pin_slot == UINT_MAX)) {
+    pin_slot = __sync_fetch_and_add(&next_pin_slot, 1) % NR_EPOCH_PINS;
+  }
+  pin = &mmio->pins[pin_slot];
+
+  for (;;) {
+    __atomic_add_fetch(&pin->count, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&mmio->committing, __ATOMIC_SEQ_CST)) {
+      return pin;
+    }
+    __atomic_sub_fetch(&pin->count, 1, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&mmio->committing, __ATOMIC_ACQUIRE)) {
+      sched_yield();
+    }
+  }
+}
+
+static inline void unpin_epoch(epoch_pin_t *pin) {
+  __atomic_sub_fetch(&pin->count, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the original data of the request into the undo log, except the
+ * bytes that the entry already holds. Those were logged earlier in the
+ * epoch, and the file may have been modified since.
+ */
+static inline void undo_log(idx_entry_t *entry, void *log_start, void *src,
+                            size_t n) {
+  void *log_end, *prev_start, *prev_end;
+
+  log_end = log_start + n;
+  prev_start = entry->log + entry->offset;
+  prev_end = prev_start + entry->len;
+
+  if (entry->len == 0 || log_end <= prev_start || log_start >= prev_end) {
+    NTSTORE(log_start, src, n);
+    PRINT("undo logging: ntstore(%p, %p, %lu)", log_start, src, n);
+    return;
+  }
+
+  if (log_start < prev_start) {
+    NTSTORE(log_start, src, prev_start - log_start);
+    PRINT("undo logging: ntstore(%p, %p, %lu)", log_start, src,
+          prev_start - log_start);
+  }
+  if (log_end > prev_end) {
+    NTSTORE(prev_end, src + (prev_end - log_start), log_end - prev_end);
+    PRINT("undo logging: ntstore(%p, %p, %lu)", prev_end,
+          src + (prev_end - log_start), log_end - prev_end);
+  }
+}
+
+/*
+ * Log the blocks of the locked entries that the write covers: the old
+ * data under UNDO, the new data under REDO. The entries and their
+ * records are persisted before the function returns.
+ */
+static void log_blocks(mmio_t *mmio, struct slist_head *entries_head,
+                       off_t offset, off_t len, const struct iovec *iov,
+                       int iovcnt) {
+  idx_entry_t *entry;
+  idx_record_t *record, *flush_start = NULL, *flush_end = NULL;
+  unsigned long log_offset, log_len, n;
+  void *log_start, *dst;
+  off_t off, ret = 0;
+  log_size_t log_size;
+  iov_iter_t iter;
 
-  /*
-   * Perform the write
-   */
-  n = len;
   off = offset;
   dst = mmio->start + offset;
-  src = (void *)buf;
+  init_iov_iter(&iter, iov, iovcnt);
 
-  SLIST_FOR_EACH_ENTRY(entry, &entries_head, list) {
+  SLIST_FOR_EACH_ENTRY(entry, entries_head, list) {
     if (entry->epoch < mmio->epoch) {
       checkpoint_entry(mmio, entry);
     }
@@ -307,20 +452,20 @@ ssize_t mmio_write(mmio_t *mmio, int fd, off_t offset, const void *buf,
     log_start = entry->log + log_offset;
     log_len = LOG_SIZE(log_size) - log_offset;
 
-    if ((unsigned long)n > log_len) {
+    n = len - ret;
+    if (n > log_len) {
       n = log_len;
     }
 
     switch (mmio->policy) {
       case UNDO:
         /* log <= original data */
-        NTSTORE(log_start, dst, n);
-        PRINT("undo logging: ntstore(%p, %p, %d)", log_start, dst, n);
+        undo_log(entry, log_start, dst, n);
         break;
       case REDO:
         /* log <= new data */
-        NTSTORE(log_start, src, n);
-        PRINT("redo logging: ntstore(%p, %p, %d)", log_start, src, n);
+        ntstore_from_iter(log_start, &iter, n);
+        PRINT("redo logging: ntstore(%p, iov, %lu)", log_start, n);
         break;
       default:
         HANDLE_ERROR("policy error");
@@ -328,7 +473,7 @@ ssize_t mmio_write(mmio_t *mmio, int fd, off_t offset, const void *buf,
     }
 
     /* If data already exists in the log (overwriting) */
-    if (entry->len > 0 && (unsigned long)n != LOG_SIZE(log_size)) {
+    if (entry->len > 0 && n != LOG_SIZE(log_size)) {
       void *log_end, *prev_start, *prev_end, *overwrite_src;
       size_t overwrite_len;
 
@@ -376,25 +521,109 @@ ssize_t mmio_write(mmio_t *mmio, int fd, off_t offset, const void *buf,
     } else {
       entry->offset = log_offset;
       entry->len = n;
-      entry->dst = (void *)((unsigned long)dst & LOG_MASK(log_size));
+      entry->dst = off & LOG_MASK(log_size);
+      entry->mmio_id = mmio->id;
       entry->policy = mmio->policy;
     }
-    FLUSH(entry, sizeof(idx_entry_t));
-    PRINT("cache flush after updating the idx_entry");
+
+    /*
+     * The entries of a full leaf table are contiguous, and so are their
+     * records, so those of neighboring blocks are flushed together.
+     */
+    record = update_idx_record(entry);
+    if (record != flush_end) {
+      if (flush_start != NULL) {
+        FLUSH(flush_start, (void *)flush_end - (void *)flush_start);
+      }
+      flush_start = record;
+    }
+    flush_end = record + 1;
 
     ret += n;
     off += n;
     dst += n;
-    src += n;
   }
-  increase_counter(&mmio->write);
+  FLUSH(flush_start, (void *)flush_end - (void *)flush_start);
+  PRINT("cache flush after updating the idx_entries");
   FENCE();
   PRINT("mfence");
+}
+
+ssize_t mmio_writev(mmio_t *mmio, int fd, off_t offset,
+                    const struct iovec *iov, int iovcnt) {
+  epoch_pin_t *pin;
+  off_t len, ret;
+  iov_iter_t iter;
+  bool append;
+  SLIST_HEAD(entries_head);
+
+  len = iov_length(iov, iovcnt);
+
+  PRINT("mmio=%p, offset=%ld, iovcnt=%d, len=%ld", mmio, offset, iovcnt, len);
+
+  if (__glibc_unlikely(len == 0)) {
+    return 0;
+  }
+
+  /*
+   * Wait here, before taking any lock, if the log pools run short.
+   */
+  throttle_writer();
+
+retry:
+  /*
+   * Acquire the reader-locks of the mmio.
+   */
+  bravo_read_lock(&mmio->rwlock);
+
+  if (__glibc_unlikely(check_expend(mmio, offset, len))) {
+    expend_mmio(mmio, fd, offset, len);
+  }
+
+  /*
+   * Keep the epoch from advancing until the write is done.
+   */
+  pin = pin_epoch(mmio);
+
+  /*
+   * Under UNDO, the blocks beyond the committed size hold no data worth
+   * preserving, since recovery truncates the file to that size. Appends
+   * are written in place without undo logs, and become durable with the
+   * size persisted at commit. Their entries are still locked, to keep
+   * readers and other writers out, but get no log blocks.
+   */
+  append = mmio->policy == UNDO &&
+           offset >= mmio->record->commit_fsize[mmio->epoch & 1];
+
+  /*
+   * Acquire all writer-locks of required logs at once for all iovecs.
+   * If the pools run dry, only a commit and a checkpoint can refill
+   * them, and the commit waits for this pin. So let everything go and
+   * wait for the committer before starting over.
+   */
+  if (__glibc_unlikely(!wrlock_log_range(&mmio->radixlog, mmio->epoch, offset,
+                                         len, &entries_head, !append))) {
+    unpin_epoch(pin);
+    bravo_read_unlock(&mmio->rwlock);
+    PRINT("out of logs, wait for the committer");
+    wait_for_log_space();
+    goto retry;
+  }
+
+  /*
+   * Perform the write
+   */
+  if (!append) {
+    log_blocks(mmio, &entries_head, offset, len, iov, iovcnt);
+  }
+  increase_counter(&mmio->write);
+  ret = len;
 
   if (mmio->policy == UNDO) {
-    NTSTORE(mmio->start + offset, buf, len);
-    PRINT("update the file after undo logging: ntstore(%p, %p, %lu)",
-          mmio->start + offset, buf, len);
+    init_iov_iter(&iter, iov, iovcnt);
+    ntstore_from_iter(mmio->start + offset, &iter, len);
+    PRINT("update the file after undo logging: ntstore(%p, iov, %lu)",
+          mmio->start + offset, len);
     FENCE();
     PRINT("mfence");
   }
@@ -407,185 +636,451 @@ ssize_t mmio_write(mmio_t *mmio, int fd, off_t offset, const void *buf,
   /*
    * Release all writer-locks.
    */
-  UNLOCK_ENTRIES(entries_head);
+  wrunlock_log_range(&entries_head);
+  unpin_epoch(pin);
 
   /*
    * Release the reader-lock of the mmio.
    */
   bravo_read_unlock(&mmio->rwlock);
 
+  account_autocommit(mmio, ret);
+
   return (ssize_t)ret;
 }
 
-inline ssize_t read_redolog(struct slist_head *entries_head, void *dst,
-                            void *file_addr, unsigned long offset,
-                            unsigned long len) {
-  idx_entry_t *entry;
+ssize_t mmio_write(mmio_t *mmio, int fd, off_t offset, const void *buf,
+                   off_t len) {
+  struct iovec iov;
+
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+
+  return mmio_writev(mmio, fd, offset, &iov, 1);
+}
+
+/*
+ * Read the part of the request in the block of the entry, from the redo
+ * log and the file, and return its length. A NULL entry means that the
+ * block has no log. The entry is read only once, so that optimistic
+ * readers can check what they got before using it; 0 is returned if it
+ * does not make sense.
+ */
+static unsigned long read_redolog_entry(idx_entry_t *entry,
+                                        log_size_t log_size, iov_iter_t *iter,
+                                        void *file_addr, unsigned long offset,
+                                        unsigned long len) {
+  idx_entry_t snap;
   void *log_start, *log_end, *req_start, *req_end, *src;
-  unsigned long log_offset, n, log_max_len;
-  log_size_t log_size;
+  unsigned long log_offset, n, start = offset;
 
-  SLIST_FOR_EACH_ENTRY(entry, entries_head, list) {
+  n = block_len(offset, log_size);
+  if (n > len) {
     n = len;
-    log_size = entry->log_size;
-    log_offset = offset & (LOG_SIZE(log_size) - 1);
-    log_max_len = LOG_SIZE(log_size) - log_offset;
+  }
 
-    if (n > log_max_len) {
-      n = log_max_len;
+  if (entry == NULL) {
+    memcpy_to_iter(iter, file_addr + offset, n);
+    PRINT("no idx_entry: memcpy(%p, %lu)", file_addr + offset, n);
+    return n;
+  }
+
+  snap.united = __atomic_load_n(&entry->united, __ATOMIC_RELAXED);
+  snap.log = __atomic_load_n(&entry->log, __ATOMIC_RELAXED);
+
+  if (__glibc_unlikely(snap.len > 0 &&
+                       (snap.log == NULL ||
+                        (unsigned long)snap.offset + snap.len >
+                            LOG_SIZE(log_size)))) {
+    return 0;
+  }
+
+  log_offset = offset & (LOG_SIZE(log_size) - 1);
+
+  if (snap.len > 0) {
+    /* If the redo log exists */
+    log_start = snap.log + snap.offset;
+    log_end = log_start + snap.len;
+    req_start = snap.log + log_offset;
+    req_end = req_start + n;
+
+    switch (check_log(req_start, req_end, log_start, log_end)) {
+      case 1:
+        src = file_addr + offset;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        break;
+      case 2:
+        src = file_addr + offset;
+        n = log_start - req_start;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        src = log_start;
+        n = req_end - log_start;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        break;
+      case 3:
+        src = file_addr + offset;
+        n = log_start - req_start;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        src = log_start;
+        n = log_end - log_start;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        src = file_addr + offset;
+        n = req_end - log_end;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        break;
+      case 4:
+        src = req_start;
+        n = req_end - req_start;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        break;
+      case 5:
+        src = req_start;
+        n = log_end - req_start;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        src = (file_addr + offset);
+        n = req_end - log_end;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        break;
+      case 6:
+        src = file_addr + offset;
+        n = req_end - req_start;
+        memcpy_to_iter(iter, src, n);
+        PRINT("read from redo: memcpy(%p, %lu)", src, n);
+        offset += n;
+        len -= n;
+        break;
+      default:
+        HANDLE_ERROR("check log");
+        break;
     }
+  } else {
+    /* If the log does not exist */
+    memcpy_to_iter(iter, file_addr + offset, n);
+    PRINT("no redo log: memcpy(%p, %lu)", file_addr + offset, n);
+    offset += n;
+    len -= n;
+  }
+  return offset - start;
+}
 
-    if (entry->len > 0) {
-      /* If the redo log exists */
-      log_start = entry->log + entry->offset;
-      log_end = log_start + entry->len;
-      req_start = entry->log + log_offset;
-      req_end = req_start + n;
+/*
+ * Read the range from the locked entries and the file. A block whose
+ * entry is not in the list, because it appeared after the entries were
+ * locked, is read from the file and caught by check_found_entries().
+ */
+inline ssize_t read_redolog(mmio_t *mmio, idx_entry_t **entries,
+                            unsigned long nr, iov_iter_t *iter,
+                            unsigned long offset, unsigned long len) {
+  idx_entry_t *entry;
+  log_size_t log_size;
+  unsigned long n, i = 0;
 
-      switch (check_log(req_start, req_end, log_start, log_end)) {
-        case 1:
-          src = file_addr + offset;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          dst += n;
-          offset += n;
-          len -= n;
-          break;
-        case 2:
-          src = file_addr + offset;
-          n = log_start - req_start;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          offset += n;
-          len -= n;
-          dst += n;
-          src = log_start;
-          n = req_end - log_start;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          dst += n;
-          offset += n;
-          len -= n;
-          break;
-        case 3:
-          src = file_addr + offset;
-          n = log_start - req_start;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          offset += n;
-          len -= n;
-          dst += n;
-          src = log_start;
-          n = log_end - log_start;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          offset += n;
-          len -= n;
-          dst += n;
-          src = (file_addr + offset) + (log_end - req_start);
-          n = req_end - log_end;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          dst += n;
-          offset += n;
-          len -= n;
-          break;
-        case 4:
-          src = req_start;
-          n = req_end - req_start;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          dst += n;
-          offset += n;
-          len -= n;
-          break;
-        case 5:
-          src = req_start;
-          n = log_end - req_start;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          offset += n;
-          len -= n;
-          dst += n;
-          src = (file_addr + offset);
-          n = req_end - log_end;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          dst += n;
-          offset += n;
-          len -= n;
-          break;
-        case 6:
-          src = file_addr + offset;
-          n = req_end - req_start;
-          memcpy(dst, src, n);
-          PRINT("read from redo: memcpy(%p, %p, %lu)", dst, src, n);
-          dst += n;
-          offset += n;
-          len -= n;
-          break;
-        default:
-          HANDLE_ERROR("check log");
-          break;
-      }
+  while (len > 0) {
+    entry = find_log_entry(&mmio->radixlog, offset, &log_size);
+
+    if (entry != NULL && i < nr && entries[i] == entry) {
+      i++;
     } else {
-      /* If the log does not exist */
-      memcpy(dst, file_addr + offset, n);
-      PRINT("no redo log: memcpy(%p, %p, %lu)", dst, file_addr + offset, n);
-      dst += n;
-      offset += n;
-      len -= n;
+      entry = NULL;
     }
+
+    n = read_redolog_entry(entry, log_size, iter, mmio->start, offset, len);
+    offset += n;
+    len -= n;
   }
   return 0;
 }
 
-ssize_t mmio_read(mmio_t *mmio, off_t offset, void *buf, size_t len) {
-  SLIST_HEAD(entries_head);
+/*
+ * Commits do not wait for readers, so the epoch may advance during a
+ * read, and an entry that appeared meanwhile may be checkpointed away
+ * before the read checks for it. The read is good only if the epoch
+ * has not moved since it started.
+ */
+static inline bool check_read_epoch(mmio_t *mmio, unsigned long epoch) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&mmio->epoch, __ATOMIC_RELAXED) == epoch;
+}
+
+/*
+ * Check, after a read under rdlock_log_range(), that no entry has
+ * appeared in a block that had none. The locked entries cannot go away.
+ */
+static bool check_found_entries(mmio_t *mmio, unsigned long offset, long len,
+                                idx_entry_t **entries, unsigned long nr) {
+  idx_entry_t *entry;
+  log_size_t log_size;
+  unsigned long i = 0;
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  while (len > 0) {
+    entry = find_log_entry(&mmio->radixlog, offset, &log_size);
+
+    if (entry != NULL) {
+      if (i == nr || entries[i] != entry) {
+        return false;
+      }
+      i++;
+    }
+
+    len -= block_len(offset, log_size);
+    offset += block_len(offset, log_size);
+  }
+  return i == nr;
+}
+
+typedef struct read_snapshot_struct {
+  idx_entry_t *entry; /* NULL if the block has no log */
+  unsigned long word;
+  unsigned long offset;
+  log_size_t log_size;
+} read_snapshot_t;
+
+#define SNAPSHOT_BUSY (-1)
+#define SNAPSHOT_TOO_LARGE (-2)
+
+/*
+ * Look up the entries covering the range and take snapshots of their
+ * locks. Return the number of blocks, or an error if a writer holds
+ * one of the entries or the range needs more than OPTIMISTIC_READ_ENTRIES.
+ */
+static int snapshot_entries(mmio_t *mmio, unsigned long offset, long len,
+                            read_snapshot_t *snaps) {
+  idx_entry_t *entry;
+  log_size_t log_size;
+  int n = 0;
+
+  while (len > 0) {
+    if (n == OPTIMISTIC_READ_ENTRIES) {
+      return SNAPSHOT_TOO_LARGE;
+    }
+
+    entry = find_log_entry(&mmio->radixlog, offset, &log_size);
+
+    if (entry != NULL) {
+      snaps[n].word = vlock_read_begin(&entry->lock);
+
+      /* The entry may have been freed and reused since it was looked up. */
+      if (vlock_read_busy(snaps[n].word) ||
+          find_log_entry(&mmio->radixlog, offset, &log_size) != entry) {
+        return SNAPSHOT_BUSY;
+      }
+    }
+    snaps[n].entry = entry;
+    snaps[n].offset = offset;
+    snaps[n].log_size = log_size;
+    n++;
+
+    len -= block_len(offset, log_size);
+    offset += block_len(offset, log_size);
+  }
+  return n;
+}
+
+/*
+ * A block without an entry must still have none. An entry that appears
+ * during the read belongs to the current epoch, so it cannot be
+ * checkpointed away unless the epoch advances, which
+ * check_read_epoch() catches.
+ */
+static inline bool check_snapshot(mmio_t *mmio, read_snapshot_t *snap) {
+  log_size_t log_size;
+
+  if (snap->entry != NULL) {
+    return !vlock_read_retry(&snap->entry->lock, snap->word);
+  }
+  return find_log_entry(&mmio->radixlog, snap->offset, &log_size) == NULL &&
+         log_size == snap->log_size;
+}
+
+/*
+ * Read without taking the locks of the entries, as in a seqlock, and
+ * check afterwards that no writer has come by. Return false if the read
+ * has to be done again under the locks.
+ */
+static bool optimistic_readv(mmio_t *mmio, off_t offset,
+                             const struct iovec *iov, int iovcnt,
+                             size_t len) {
+  read_snapshot_t snaps[OPTIMISTIC_READ_ENTRIES];
+  iov_iter_t iter;
+  unsigned long off, remain, n, epoch;
+  int nr, i, retries;
+  bool valid;
+
+  for (retries = 0; retries < OPTIMISTIC_READ_RETRIES; retries++) {
+    epoch = __atomic_load_n(&mmio->epoch, __ATOMIC_ACQUIRE);
+    nr = snapshot_entries(mmio, offset, len, snaps);
+    if (nr == SNAPSHOT_TOO_LARGE) {
+      return false;
+    } else if (nr == SNAPSHOT_BUSY) {
+      __builtin_ia32_pause();
+      continue;
+    }
+
+    init_iov_iter(&iter, iov, iovcnt);
+    valid = true;
+
+    switch (mmio->policy) {
+      case UNDO:
+        memcpy_to_iter(&iter, mmio->start + offset, len);
+        break;
+      case REDO:
+        off = offset;
+        remain = len;
+        for (i = 0; i < nr && valid; i++) {
+          n = read_redolog_entry(snaps[i].entry, snaps[i].log_size, &iter,
+                                 mmio->start, off, remain);
+          valid = n > 0;
+          off += n;
+          remain -= n;
+        }
+        break;
+      default:
+        HANDLE_ERROR("policy error");
+        break;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    for (i = 0; i < nr && valid; i++) {
+      valid = check_snapshot(mmio, &snaps[i]);
+    }
+
+    if (valid && check_read_epoch(mmio, epoch)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ssize_t mmio_readv(mmio_t *mmio, off_t offset, const struct iovec *iov,
+                   int iovcnt) {
+  idx_entry_t *local_entries[LOCAL_READ_ENTRIES], **entries;
+  epoch_pin_t *pin = NULL;
+  iov_iter_t iter;
+  size_t len;
+  unsigned long nr, epoch;
+  int retries = 0;
+  bool valid;
+
+  len = iov_length(iov, iovcnt);
+
+  PRINT("mmio=%p, offset=%ld, iovcnt=%d, len=%lu", mmio, offset, iovcnt, len);
 
   /*
    * Acquire the reader-locks of the mmio.
    */
   bravo_read_lock(&mmio->rwlock);
 
-  /*
-   * Acquire all reader-locks of required logs.
-   */
-  LOCK_ENTRIES(rd, mmio, offset, len, entries_head);
-
   /*
    * Check the file size to see if the requested read is possible.
    */
-  if (check_fsize(mmio, offset, len)) {
+  if (offset >= mmio->fsize) {
+    len = 0;
+  } else if (check_fsize(mmio, offset, len)) {
     len = mmio->fsize - offset;
     PRINT("the requested length exceeds the file size. the reset length=%lu",
           len);
   }
 
   /*
-   * Perform the read
+   * Most reads do not race with a writer, and need no locks.
    */
-  switch (mmio->policy) {
-    case UNDO:
-      /* original file => buf */
-      memcpy(buf, mmio->start + offset, len);
-      PRINT("read from the file: memcpy(%p, %p, %lu)", buf,
-            mmio->start + offset, len);
-      break;
-    case REDO:
-      /* logs & original file => buf */
-      read_redolog(&entries_head, buf, mmio->start, offset, len);
-      break;
-    default:
-      HANDLE_ERROR("policy error");
-      break;
+  if (OPTIMISTIC_READ_ENTRIES > 0 && len > 0 &&
+      optimistic_readv(mmio, offset, iov, iovcnt, len)) {
+    increase_counter(&mmio->read);
+    bravo_read_unlock(&mmio->rwlock);
+    return len;
+  }
+
+  entries = local_entries;
+  if (len > 0 && max_log_blocks(offset, len) > LOCAL_READ_ENTRIES) {
+    entries = (idx_entry_t **)malloc(max_log_blocks(offset, len) *
+                                     sizeof(idx_entry_t *));
+    if (__glibc_unlikely(entries == NULL)) {
+      HANDLE_ERROR("malloc");
+    }
   }
-  increase_counter(&mmio->read);
 
   /*
-   * Release all reader-locks.
+   * Acquire the reader-locks of the logs that exist, at once for all
+   * iovecs. The read is done again if a writer has logged a block that
+   * had no log meanwhile. Once the reads have raced with commits a few
+   * times, the epoch is pinned, so that the next read only has to retry
+   * for the blocks that get their first log, and finishes.
    */
-  UNLOCK_ENTRIES(entries_head);
+  do {
+    if (__glibc_unlikely(retries++ == OPTIMISTIC_READ_RETRIES)) {
+      pin = pin_epoch(mmio);
+    }
+    epoch = __atomic_load_n(&mmio->epoch, __ATOMIC_ACQUIRE);
+    nr = rdlock_log_range(&mmio->radixlog, offset, len, entries);
+
+    /*
+     * Perform the read
+     */
+    init_iov_iter(&iter, iov, iovcnt);
+
+    switch (mmio->policy) {
+      case UNDO:
+        /* original file => buf */
+        memcpy_to_iter(&iter, mmio->start + offset, len);
+        PRINT("read from the file: memcpy(iov, %p, %lu)",
+              mmio->start + offset, len);
+        break;
+      case REDO:
+        /* logs & original file => buf */
+        read_redolog(mmio, entries, nr, &iter, offset, len);
+        break;
+      default:
+        HANDLE_ERROR("policy error");
+        break;
+    }
+    valid = check_found_entries(mmio, offset, len, entries, nr) &&
+            check_read_epoch(mmio, epoch);
+
+    /*
+     * Release all reader-locks.
+     */
+    rdunlock_log_range(entries, nr);
+  } while (!valid);
+
+  if (pin != NULL) {
+    unpin_epoch(pin);
+  }
+
+  if (entries != local_entries) {
+    free(entries);
+  }
+  increase_counter(&mmio->read);
 
   /*
    * Release the reader-lock of the mmio.
@@ -595,6 +1090,15 @@ ssize_t mmio_read(mmio_t *mmio, off_t offset, void *buf, size_t len) {
   return len;
 }
 
+ssize_t mmio_read(mmio_t *mmio, off_t offset, void *buf, size_t len) {
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+
+  return mmio_readv(mmio, offset, &iov, 1);
+}
+
 static inline void determine_policy(mmio_t *mmio) {
   unsigned long total_cnt, write_ratio;
   policy_t new_policy;
@@ -602,7 +1106,7 @@ static inline void determine_policy(mmio_t *mmio) {
   total_cnt = mmio->read + mmio->write;
 
   if (total_cnt > 0) {
-    write_ratio = mmio->write / total_cnt * 100;
+    write_ratio = mmio->write * 100 / total_cnt;
 
     if (write_ratio > HYBRID_WRITE_RATIO) {
       new_policy = REDO;
@@ -613,24 +1117,100 @@ static inline void determine_policy(mmio_t *mmio) {
     mmio->read = 0;
     mmio->write = 0;
 
+    /*
+     * No one may log under the old policy meanwhile. Writers may already
+     * have logged in the new epoch, and those entries have to be read and
+     * recovered under the old policy, so the policy is only switched if
+     * the checkpoint leaves no entry behind, and no other checkpoint
+     * holds tables it has yet to push back. Otherwise the next commit
+     * decides again.
+     */
     if (mmio->policy != new_policy) {
-      checkpoint_mmio(mmio);
+      bravo_write_lock(&mmio->rwlock);
+      __checkpoint_mmio(mmio, true);
+      if (__atomic_load_n(&mmio->radixlog.dirty, __ATOMIC_SEQ_CST) == NULL &&
+          __atomic_load_n(&mmio->checkpointers, __ATOMIC_SEQ_CST) == 0) {
+        mmio->policy = new_policy;
+      }
+      bravo_write_unlock(&mmio->rwlock);
     }
   }
 }
 
-void commit_mmio(mmio_t *mmio) {
-  /*
-   * Acquire the writer-lock of the mmio.
-   */
-  bravo_write_lock(&mmio->rwlock);
+/*
+ * The stages of a commit. A commit of one mmio runs them in a row, and
+ * a transaction runs each stage over all of its mmios, so that their
+ * epochs advance together.
+ */
+
+/*
+ * Become the leader of the next commit of the mmio, once the running
+ * one is over.
+ */
+void lead_commit(mmio_t *mmio) {
+  MUTEX_LOCK(&mmio->commit_mutex);
+  while (mmio->commit_started != mmio->commit_done) {
+    pthread_cond_wait(&mmio->commit_cond, &mmio->commit_mutex);
+  }
+  mmio->commit_started++;
+  MUTEX_UNLOCK(&mmio->commit_mutex);
+}
+
+void finish_commit(mmio_t *mmio) {
+  MUTEX_LOCK(&mmio->commit_mutex);
+  mmio->commit_done++;
+  pthread_cond_broadcast(&mmio->commit_cond);
+  MUTEX_UNLOCK(&mmio->commit_mutex);
+}
+
+/*
+ * Hold off new writers, and wait for those pinned to the epoch.
+ */
+void quiesce_writers(mmio_t *mmio) {
+  int i, spins;
+
+  __atomic_store_n(&mmio->committing, true, __ATOMIC_SEQ_CST);
+
+  for (i = 0; i < NR_EPOCH_PINS; i++) {
+    spins = 0;
+    while (__atomic_load_n(&mmio->pins[i].count, __ATOMIC_ACQUIRE) != 0) {
+      if (++spins < POOL_WAIT_RETRIES) {
+        __builtin_ia32_pause();
+      } else {
+        sched_yield();
+      }
+    }
+  }
+}
+
+/*
+ * Flush the file size of the next epoch. It sits in the slot of the
+ * other parity, so recovery reads it only once the epoch is persisted.
+ */
+void flush_next_fsize(mmio_t *mmio) {
+  unsigned long epoch = mmio->epoch + 1;
+
+  mmio->record->commit_fsize[epoch & 1] = mmio->fsize;
+  FLUSH(&mmio->record->commit_fsize[epoch & 1], sizeof(off_t));
+}
+
+void flush_next_epoch(mmio_t *mmio) {
+  mmio->record->epoch = mmio->epoch + 1;
+  FLUSH(&mmio->record->epoch, sizeof(unsigned long));
+}
+
+/*
+ * Start the next epoch, once it is persisted, and let the writers in.
+ */
+void publish_epoch(mmio_t *mmio) {
+  mmio->logged = 0;
+  mmio->epoch_time = get_coarse_time_ms();
 
   /*
-   * Increase the golbal epoch number
+   * The checkpoint workers see the new epoch only once it is persisted.
    */
-  mmio->epoch++;
-  FLUSH(&mmio->epoch, sizeof(unsigned long));
-  FENCE();
+  __atomic_store_n(&mmio->epoch, mmio->epoch + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&mmio->committing, false, __ATOMIC_RELEASE);
   PRINT("epoch=%lu\n", mmio->epoch);
 
 #if HYBRID_LOGGING
@@ -642,7 +1222,58 @@ void commit_mmio(mmio_t *mmio) {
 #endif /* HYBRID_LOGGING */
 
   /*
-   * Release the writer-lock of the mmio.
+   * Let a checkpoint worker clean up the entries of the old epoch.
    */
-  bravo_write_unlock(&mmio->rwlock);
+  request_checkpoint(mmio);
+}
+
+/*
+ * Commit the epoch of the mmio without stopping its readers. New writers
+ * wait while the writers in flight finish the epoch and its file size
+ * and number are persisted, and then start the next epoch. Only the
+ * leader of a group commit gets here.
+ */
+static void advance_epoch(mmio_t *mmio) {
+  quiesce_writers(mmio);
+
+  /*
+   * Persist the file size of the new epoch before the epoch itself,
+   * so that recovery always finds the size matching the epoch.
+   */
+  flush_next_fsize(mmio);
+  FENCE();
+
+  flush_next_epoch(mmio);
+  FENCE();
+
+  publish_epoch(mmio);
+}
+
+/*
+ * Concurrent commits of an mmio are grouped. A caller is covered by the
+ * first commit that starts after it arrives, since that commit waits for
+ * every write done before. The first caller to find no commit running
+ * leads the next one, and the callers that arrive meanwhile wait for it
+ * and return with it.
+ */
+void commit_mmio(mmio_t *mmio) {
+  unsigned long target;
+
+  MUTEX_LOCK(&mmio->commit_mutex);
+  target = mmio->commit_started + 1;
+
+  while (mmio->commit_done < target) {
+    if (mmio->commit_started == mmio->commit_done) {
+      mmio->commit_started++;
+      MUTEX_UNLOCK(&mmio->commit_mutex);
+
+      advance_epoch(mmio);
+      finish_commit(mmio);
+
+      MUTEX_LOCK(&mmio->commit_mutex);
+    } else {
+      pthread_cond_wait(&mmio->commit_cond, &mmio->commit_mutex);
+    }
+  }
+  MUTEX_UNLOCK(&mmio->commit_mutex);
 }
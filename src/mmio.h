@@ -2,14 +2,36 @@
 #define LIBNVMMIO_MMAP_H
 
 #include <libpmem.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
+#include "list.h"
 #include "radixlog.h"
 #include "slist.h"
 #include "bravo.h"
 
 typedef enum { UNDO, REDO } policy_t;
 
+/*
+ * What recovery needs to know about an mmio, kept in the mmio pool in
+ * pmem at the same slot as the mmio.
+ */
+typedef struct mmio_record_struct {
+  unsigned long ino;
+  unsigned long epoch;
+  off_t commit_fsize[2]; /* indexed by the parity of the epoch */
+  char path[PATH_MAX];
+} mmio_record_t;
+
+/*
+ * Writers in flight in the epoch, counted per slot of threads so that
+ * writers do not share a cache line.
+ */
+typedef struct epoch_pin_struct {
+  unsigned long count;
+} __attribute__((aligned(CACHELINE_SIZE))) epoch_pin_t;
+
 typedef struct mmio_struct {
   bravo_rwlock_t rwlock;
   void *start;
@@ -22,22 +44,54 @@ typedef struct mmio_struct {
   unsigned long read;
   unsigned long write;
   off_t fsize;
-  pthread_t checkpoint_thread;
+  mmio_record_t *record;
+  struct list_head checkpoint_list;
+  bool checkpoint_queued;
+  bool checkpoint_running;
+  int checkpointers; /* checkpoints running without the write lock */
+  struct list_head autocommit_list;
+  unsigned long logged;     /* bytes logged in the current epoch */
+  unsigned long epoch_time; /* when the current epoch started (ms) */
   int ref;
+  int id;
+  int tx_holds;    /* open transactions that hold the file */
+  bool committing; /* new writers wait until the epoch advances */
+  pthread_mutex_t commit_mutex;
+  pthread_cond_t commit_cond;
+  unsigned long commit_started; /* commits led so far */
+  unsigned long commit_done;
+  epoch_pin_t pins[NR_EPOCH_PINS];
 } mmio_t;
 
+typedef struct iov_iter_struct {
+  const struct iovec *iov;
+  int iovcnt;
+  size_t iov_offset;
+} iov_iter_t;
+
 #define NTSTORE(dst, src, n) pmem_memcpy_nodrain(dst, src, n)
 #define FENCE() pmem_drain();
 #define FLUSH(addr, n) pmem_flush(addr, n);
 
-ssize_t read_redolog(struct slist_head *entries_head, void *dst,
-                     void *file_addr, unsigned long offset, unsigned long len);
+ssize_t read_redolog(mmio_t *mmio, idx_entry_t **entries, unsigned long nr,
+                     iov_iter_t *iter, unsigned long offset, unsigned long len);
 ssize_t mmio_read(mmio_t *mmio, off_t offset, void *buf, size_t len);
+ssize_t mmio_readv(mmio_t *mmio, off_t offset, const struct iovec *iov,
+                   int iovcnt);
 ssize_t mmio_write(mmio_t *mmio, int fd, off_t offset, const void *buf,
                    off_t len);
+ssize_t mmio_writev(mmio_t *mmio, int fd, off_t offset,
+                    const struct iovec *iov, int iovcnt);
 
-void create_checkpoint_thread(mmio_t *mmio);
-void checkpoint_mmio(mmio_t *mmio);
+unsigned long checkpoint_mmio(mmio_t *mmio);
+void drain_mmio(mmio_t *mmio);
 void commit_mmio(mmio_t *mmio);
 
+void lead_commit(mmio_t *mmio);
+void finish_commit(mmio_t *mmio);
+void quiesce_writers(mmio_t *mmio);
+void flush_next_fsize(mmio_t *mmio);
+void flush_next_epoch(mmio_t *mmio);
+void publish_epoch(mmio_t *mmio);
+
 #endif /* LIBNVMMIO_MMAP_H */
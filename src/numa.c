@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include "numa.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+#include "config.h"
+#include "debug.h"
+#include "env.h"
+
+/*
+ * The pmem paths of PMEM_PATH belong to NUMA nodes 0, 1, ... in order.
+ * A CPU of node n uses the pools of node (n % nr_nodes). If the machine
+ * has a single node, e.g. when the nodes are faked with directories
+ * for testing, the CPUs are spread over the pools round-robin.
+ *
+ * When the local pools are exhausted, the other nodes are tried in the
+ * order of their distance from the local one.
+ */
+
+#define NODE_DIR "/sys/devices/system/node"
+#define NODE_FILE_PATH NODE_DIR "/node%d/%s"
+
+static int nr_pool_nodes = 1;
+static int nr_cpus = 0;
+static int *cpu_to_node = NULL;
+static int fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+static bool read_node_file(int node, const char *name, char *buf, int len) {
+  char path[PATH_MAX];
+  FILE *fp;
+  bool s;
+
+  sprintf(path, NODE_FILE_PATH, node, name);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return false;
+  }
+
+  s = fgets(buf, len, fp) != NULL;
+  fclose(fp);
+  return s;
+}
+
+/*
+ * Map the CPUs to the pools by the real topology and return the number
+ * of real nodes.
+ */
+static int map_real_nodes(int *distance) {
+  char buf[4096], *str, *end;
+  int cpus[CPU_SETSIZE];
+  DIR *dirptr;
+  struct dirent *file;
+  int node, n, i, nr_real = 0;
+
+  dirptr = opendir(NODE_DIR);
+  if (dirptr == NULL) {
+    return 0;
+  }
+
+  while ((file = readdir(dirptr)) != NULL) {
+    if (sscanf(file->d_name, "node%d%n", &node, &n) != 1 ||
+        file->d_name[n] != '\0' || node < 0) {
+      continue;
+    }
+
+    if (!read_node_file(node, "cpulist", buf, sizeof(buf))) {
+      continue;
+    }
+    nr_real++;
+
+    n = parse_cpu_list(buf, cpus, CPU_SETSIZE);
+    for (i = 0; i < n; i++) {
+      if (cpus[i] < nr_cpus) {
+        cpu_to_node[cpus[i]] = node % nr_pool_nodes;
+      }
+    }
+
+    if (node >= nr_pool_nodes ||
+        !read_node_file(node, "distance", buf, sizeof(buf))) {
+      continue;
+    }
+
+    str = buf;
+    for (i = 0; i < nr_pool_nodes; i++) {
+      distance[node * MAX_NUMA_NODES + i] = (int)strtol(str, &end, 10);
+      if (end == str) {
+        break;
+      }
+      str = end;
+    }
+  }
+
+  closedir(dirptr);
+  return nr_real;
+}
+
+static void init_fallback(int *distance) {
+  int local, i, j, node;
+
+  for (local = 0; local < nr_pool_nodes; local++) {
+    for (i = 0; i < nr_pool_nodes; i++) {
+      node = (local + i) % nr_pool_nodes;
+
+      /* Keep the round-robin order among nodes at the same distance. */
+      for (j = i; j > 1 && distance[local * MAX_NUMA_NODES + node] <
+                               distance[local * MAX_NUMA_NODES +
+                                        fallback[local][j - 1]];
+           j--) {
+        fallback[local][j] = fallback[local][j - 1];
+      }
+      fallback[local][j] = node;
+    }
+  }
+}
+
+void init_numa(int nr_nodes) {
+  int distance[MAX_NUMA_NODES * MAX_NUMA_NODES];
+  int cpu;
+
+  nr_pool_nodes = nr_nodes;
+  nr_cpus = get_nprocs_conf();
+
+  cpu_to_node = (int *)calloc(nr_cpus, sizeof(int));
+  if (__glibc_unlikely(cpu_to_node == NULL)) {
+    HANDLE_ERROR("calloc");
+  }
+  memset(distance, 0, sizeof(distance));
+
+  if (nr_pool_nodes > 1 && map_real_nodes(distance) < 2) {
+    for (cpu = 0; cpu < nr_cpus; cpu++) {
+      cpu_to_node[cpu] = cpu % nr_pool_nodes;
+    }
+    PRINT("faking %d nodes on %d cpus", nr_pool_nodes, nr_cpus);
+  }
+
+  init_fallback(distance);
+}
+
+int get_numa_node(void) {
+  int cpu;
+
+  if (nr_pool_nodes == 1) {
+    return 0;
+  }
+
+  cpu = sched_getcpu();
+  if (__glibc_unlikely(cpu < 0 || cpu >= nr_cpus)) {
+    return 0;
+  }
+  return cpu_to_node[cpu];
+}
+
+int get_fallback_node(int local, int i) { return fallback[local][i]; }
@@ -0,0 +1,8 @@
+#ifndef LIBNVMMIO_NUMA_H
+#define LIBNVMMIO_NUMA_H
+
+void init_numa(int nr_nodes);
+int get_numa_node(void);
+int get_fallback_node(int local, int i);
+
+#endif /* LIBNVMMIO_NUMA_H */
@@ -1,6 +1,5 @@
 #include "radixlog.h"
 
-#include <limits.h>
 #include <stdbool.h>
 
 #include "allocator.h"
@@ -8,21 +7,69 @@
 #include "debug.h"
 #include "slist.h"
 
+/*
+ * Tables are added to the tree by writers, which must not wait for them,
+ * so the caller returns NULL if the tables run out.
+ */
 #define ALLOC_TABLE(table, type, parent, index)                                \
   do {                                                                         \
-    table = alloc_log_table(type);                                             \
+    table = try_alloc_log_table(type);                                         \
+    if (__glibc_unlikely(table == NULL)) {                                     \
+      return NULL;                                                             \
+    }                                                                          \
     if (!__sync_bool_compare_and_swap(&parent->entries[index], NULL, table)) { \
       free_log_table(table);                                                   \
       table = parent->entries[index];                                          \
     }                                                                          \
   } while (0);
 
-inline bool check_prev_table(unsigned long prev_table_index,
-                             unsigned long offset) {
-  if (prev_table_index == ((offset >> LMD_SHIFT) & TABLE_MASK)) {
-    return true;
+/*
+ * Each thread caches the leaf tables it looked up last, in a small
+ * direct-mapped array keyed by the root and the 2MB index of the offset.
+ * The tables of a root are only dropped all together, when the root is
+ * set up for another file, which bumps its generation and so turns the
+ * cached ones into misses.
+ */
+#define TABLE_CACHE_SIZE (16)
+
+typedef struct table_cache_struct {
+  radix_root_t *root;
+  unsigned long generation;
+  unsigned long index;
+  log_table_t *table;
+} table_cache_t;
+
+static __thread table_cache_t table_cache[TABLE_CACHE_SIZE];
+
+static inline table_cache_t *get_table_cache(radix_root_t *root,
+                                             unsigned long index) {
+  return &table_cache[(index ^ ((unsigned long)root >> 6)) &
+                      (TABLE_CACHE_SIZE - 1)];
+}
+
+static inline log_table_t *lookup_table_cache(radix_root_t *root,
+                                              unsigned long offset) {
+  table_cache_t *cache;
+  unsigned long index = offset >> LMD_SHIFT;
+
+  cache = get_table_cache(root, index);
+  if (cache->root == root && cache->index == index &&
+      cache->generation == root->generation) {
+    return cache->table;
   }
-  return false;
+  return NULL;
+}
+
+static inline void fill_table_cache(radix_root_t *root, unsigned long offset,
+                                    log_table_t *table) {
+  table_cache_t *cache;
+  unsigned long index = offset >> LMD_SHIFT;
+
+  cache = get_table_cache(root, index);
+  cache->root = root;
+  cache->generation = root->generation;
+  cache->index = index;
+  cache->table = table;
 }
 
 static inline void atomic_increase(int *count) {
@@ -90,23 +137,110 @@ void init_radixlog(radix_root_t *root, unsigned long filesize) {
   } while (type >= deepest_table_type);
 
   root->skip = table;
-  root->prev_table_index = ULONG_MAX;
+  root->dirty = NULL;
+  root->generation++;
+}
+
+static void release_log_table(log_table_t *table) {
+  idx_entry_t *entry;
+  void **slots;
+  unsigned long i, nr_slots;
+
+  if (table->type > TABLE) {
+    for (i = 0; i < PTRS_PER_TABLE; i++) {
+      if (table->entries[i] != NULL) {
+        release_log_table(table->entries[i]);
+      }
+    }
+    free_log_table(table);
+    return;
+  }
+
+  if (table->type == SPARSE_TABLE) {
+    slots = table->sparse.slots;
+    nr_slots = SPARSE_SLOTS;
+  } else {
+    slots = table->entries;
+    nr_slots = PTRS_PER_TABLE;
+  }
+
+  for (i = 0; i < nr_slots; i++) {
+    entry = slots[i];
+    if (entry != NULL) {
+      free_log_entry(table, entry, entry->log_size);
+    }
+  }
+
+  if (table->type == SPARSE_TABLE) {
+    if (table->sparse.overflow != NULL) {
+      release_log_table(table->sparse.overflow);
+    }
+  } else if (table->chunk != NULL) {
+    free_idx_chunk(table->chunk, table->log_size);
+  }
+  free_log_table(table);
+}
+
+/*
+ * Free the tables of a root that nobody uses any more, with the entries
+ * left in them. The mmio has been committed and drained, so every REDO
+ * entry has been written back and no record is needed for recovery.
+ */
+void release_radixlog(radix_root_t *root) {
+  if (root->lgd != NULL) {
+    release_log_table(root->lgd);
+  }
+  root->lgd = NULL;
+  root->skip = NULL;
+  root->dirty = NULL;
+}
+
+/*
+ * Make the tree deep enough for offsets up to maxoff. The tables above
+ * the skip table are all there from the start, with the skip table at
+ * index 0 of its parent, so the tree grows by moving the skip pointer
+ * up. A lookup that still starts at the old skip table finds the same
+ * leaf tables for the offsets that it covers, so lookups go on without
+ * a lock, and the leaf tables cached by threads remain valid.
+ */
+void grow_radixlog(radix_root_t *root, unsigned long maxoff) {
+  table_type_t type;
+  log_table_t *table;
+
+  type = get_deepest_table_type(maxoff);
+  if (type <= root->skip->type) {
+    return;
+  }
+
+  table = root->lgd;
+  while (table->type > type) {
+    table = table->entries[0];
+  }
+  PRINT("grow the tree: skip to %d", table->type);
+  __atomic_store_n(&root->skip, table, __ATOMIC_RELEASE);
 }
 
 log_table_t *find_log_table(radix_root_t *root, unsigned long offset) {
-  log_table_t *lgd, *lud, *lmd, *table = NULL;
+  log_table_t *skip, *lgd, *lud, *lmd, *table = NULL;
   unsigned long index;
 
-  if (root->skip) {
-    switch (root->skip->type) {
+  table = lookup_table_cache(root, offset);
+  if (table != NULL) {
+    return table;
+  }
+
+  skip = __atomic_load_n(&root->skip, __ATOMIC_ACQUIRE);
+
+  if (skip) {
+    switch (skip->type) {
       case TABLE:
         PRINT("skip to TABLE");
-        table = root->skip;
+        table = skip;
         break;
 
       case LMD:
         PRINT("skip to LMD");
-        lmd = root->skip;
+        lmd = skip;
 
         index = LMD_INDEX(offset);
         PRINT("LMD index=%lu", index);
@@ -119,7 +253,7 @@ log_table_t *find_log_table(radix_root_t *root, unsigned long offset) {
 
       case LUD:
         PRINT("skip to LUD");
-        lud = root->skip;
+        lud = skip;
 
         index = LUD_INDEX(offset);
         PRINT("LUD index=%lu", index);
@@ -140,7 +274,7 @@ log_table_t *find_log_table(radix_root_t *root, unsigned long offset) {
 
       case LGD:
         PRINT("skip to LGD");
-        lgd = root->skip;
+        lgd = skip;
 
         index = LGD_INDEX(offset);
         PRINT("LGD index=%lu", index);
@@ -172,41 +306,47 @@ log_table_t *find_log_table(radix_root_t *root, unsigned long offset) {
         break;
     }
   }
+
+  if (table != NULL) {
+    fill_table_cache(root, offset, table);
+  }
   return table;
 }
 
 log_table_t *get_log_table(radix_root_t *root, unsigned long offset) {
-  log_table_t *lgd, *lud, *lmd, *table;
+  log_table_t *skip, *lgd, *lud, *lmd, *table;
   unsigned long index;
 
-  if (check_prev_table(root->prev_table_index, offset)) {
-    PRINT("reuse the previous table: prev=%lx, current=%lx",
-          root->prev_table_index, offset);
-    return root->prev_table;
+  table = lookup_table_cache(root, offset);
+  if (table != NULL) {
+    PRINT("reuse the cached table: offset=%lx", offset);
+    return table;
   }
 
-  switch (root->skip->type) {
+  skip = __atomic_load_n(&root->skip, __ATOMIC_ACQUIRE);
+
+  switch (skip->type) {
     case TABLE:
       PRINT("skip to TABLE");
-      table = root->skip;
+      table = skip;
       break;
 
     case LMD:
       PRINT("skip to LMD");
-      lmd = root->skip;
+      lmd = skip;
 
       index = LMD_INDEX(offset);
       PRINT("LMD index=%lu", index);
       table = lmd->entries[index];
 
       if (table == NULL) {
-        ALLOC_TABLE(table, TABLE, lmd, index);
+        ALLOC_TABLE(table, SPARSE_TABLE, lmd, index);
       }
       break;
 
     case LUD:
       PRINT("skip to LUD");
-      lud = root->skip;
+      lud = skip;
 
       index = LUD_INDEX(offset);
       PRINT("LUD index=%lu", index);
@@ -221,13 +361,13 @@ log_table_t *get_log_table(radix_root_t *root, unsigned long offset) {
       table = lmd->entries[index];
 
       if (table == NULL) {
-        ALLOC_TABLE(table, TABLE, lmd, index);
+        ALLOC_TABLE(table, SPARSE_TABLE, lmd, index);
       }
       break;
 
     case LGD:
       PRINT("skip to LGD");
-      lgd = root->skip;
+      lgd = skip;
 
       index = LGD_INDEX(offset);
       PRINT("LGD index=%lu", index);
@@ -250,7 +390,7 @@ log_table_t *get_log_table(radix_root_t *root, unsigned long offset) {
       table = lmd->entries[index];
 
       if (table == NULL) {
-        ALLOC_TABLE(table, TABLE, lmd, index);
+        ALLOC_TABLE(table, SPARSE_TABLE, lmd, index);
       }
       break;
 
@@ -259,8 +399,7 @@ log_table_t *get_log_table(radix_root_t *root, unsigned long offset) {
       break;
   }
 
-  root->prev_table = table;
-  root->prev_table_index = TABLE_MASK & (offset >> LMD_SHIFT);
+  fill_table_cache(root, offset, table);
   return table;
 }
 
@@ -296,21 +435,465 @@ retry_get_log_size:
   }
 }
 
-inline idx_entry_t *get_log_entry(unsigned long epoch, log_table_t *table,
-                                  unsigned long index, log_size_t log_size) {
+/*
+ * Link the table in the dirty list of the root unless it is already there.
+ * The list is a lock-free stack that is only emptied as a whole.
+ */
+void push_dirty_table(radix_root_t *root, log_table_t *table) {
+  log_table_t *head;
+
+  if (table->dirty || !__sync_bool_compare_and_swap(&table->dirty, 0, 1)) {
+    return;
+  }
+
+  do {
+    head = root->dirty;
+    table->dirty_next = head;
+  } while (!__sync_bool_compare_and_swap(&root->dirty, head, table));
+}
+
+/*
+ * Take all dirty tables. The caller must clear table->dirty
+ * before it looks at the dirty map of each table.
+ */
+log_table_t *pop_dirty_tables(radix_root_t *root) {
+  return __sync_lock_test_and_set(&root->dirty, NULL);
+}
+
+static inline void mark_dirty_entry(radix_root_t *root, log_table_t *table,
+                                    unsigned long index) {
+  __sync_fetch_and_or(&table->dirty_map[index / BITS_PER_LONG],
+                      1UL << (index % BITS_PER_LONG));
+  push_dirty_table(root, table);
+}
+
+/*
+ * Must be called before the entry is removed from the table.
+ */
+inline void clear_dirty_entry(log_table_t *table, unsigned long index) {
+  __sync_fetch_and_and(&table->dirty_map[index / BITS_PER_LONG],
+                       ~(1UL << (index % BITS_PER_LONG)));
+}
+
+/*
+ * Leaf tables below an LMD start sparse, since most of the 2MB regions
+ * of a file see a few blocks logged at a time. A sparse leaf is less
+ * than a tenth of a full table. An index takes the first free slot among
+ * the SPARSE_PROBES ones from its hash on, or else its slot in a full
+ * overflow table. Slots are never taken back, so an index lives in one
+ * place only, and a lookup ends at the first free slot.
+ */
+#define SPARSE_PROBES (8)
+#define SPARSE_HASH(INDEX) \
+  ((((unsigned int)(INDEX) * 2654435761U) >> 27) & (SPARSE_SLOTS - 1))
+
+/*
+ * Return the slot of the index in the leaf table, or NULL if the index
+ * has not been given one.
+ */
+static inline void **find_leaf_slot(log_table_t *table, unsigned long index) {
+  log_table_t *overflow;
+  unsigned short tag;
+  int i, n;
+
+  if (table->type != SPARSE_TABLE) {
+    return &table->entries[index];
+  }
+
+  /* Most indexes of a region that has spilled are in the overflow table. */
+  overflow = __atomic_load_n(&table->sparse.overflow, __ATOMIC_ACQUIRE);
+  if (overflow != NULL && overflow->entries[index] != NULL) {
+    return &overflow->entries[index];
+  }
+
+  for (n = 0, i = SPARSE_HASH(index); n < SPARSE_PROBES;
+       n++, i = (i + 1) & (SPARSE_SLOTS - 1)) {
+    tag = __atomic_load_n(&table->sparse.tags[i], __ATOMIC_ACQUIRE);
+    if (tag == index + 1) {
+      return &table->sparse.slots[i];
+    }
+    if (tag == 0) {
+      return NULL;
+    }
+  }
+
+  overflow = __atomic_load_n(&table->sparse.overflow, __ATOMIC_ACQUIRE);
+  return overflow ? &overflow->entries[index] : NULL;
+}
+
+/*
+ * Return the slot of the index in the leaf table, giving it one if it
+ * has none. The table whose dirty map covers the slot is returned in
+ * owner, and the bit of the slot in bit. NULL means that a sparse table
+ * had to spill but the tables ran out.
+ */
+static void **claim_leaf_slot(log_table_t *table, unsigned long index,
+                              log_table_t **owner, unsigned long *bit) {
+  log_table_t *overflow;
+  unsigned short tag;
+  int i, n;
+
+  if (table->type != SPARSE_TABLE) {
+    *owner = table;
+    *bit = index;
+    return &table->entries[index];
+  }
+
+  for (n = 0, i = SPARSE_HASH(index); n < SPARSE_PROBES;
+       n++, i = (i + 1) & (SPARSE_SLOTS - 1)) {
+    tag = __atomic_load_n(&table->sparse.tags[i], __ATOMIC_ACQUIRE);
+    if (tag == 0) {
+      tag = __sync_val_compare_and_swap(&table->sparse.tags[i], 0, index + 1);
+      if (tag == 0) {
+        tag = index + 1;
+      }
+    }
+    if (tag == index + 1) {
+      *owner = table;
+      *bit = i;
+      return &table->sparse.slots[i];
+    }
+  }
+
+  overflow = table->sparse.overflow;
+  if (overflow == NULL) {
+    PRINT("spill the sparse table");
+    overflow = try_alloc_log_table(TABLE);
+    if (__glibc_unlikely(overflow == NULL)) {
+      return NULL;
+    }
+    overflow->log_size = table->log_size;
+    if (!__sync_bool_compare_and_swap(&table->sparse.overflow, NULL,
+                                      overflow)) {
+      free_log_table(overflow);
+      overflow = table->sparse.overflow;
+    }
+  }
+
+  *owner = overflow;
+  *bit = index;
+  return &overflow->entries[index];
+}
+
+/*
+ * A full leaf table keeps its entries in a chunk of its own, in the order
+ * of its indexes, which comes with the first entry of the table. The
+ * entry of an index is taken out of the chunk and put back to it, but
+ * it goes through the slot like the entries of the pool.
+ */
+static idx_entry_t *get_leaf_chunk(log_table_t *table) {
+  idx_entry_t *chunk;
+
+  chunk = __atomic_load_n(&table->chunk, __ATOMIC_ACQUIRE);
+  if (chunk == NULL) {
+    chunk = alloc_idx_chunk(table->log_size);
+    if (__glibc_unlikely(chunk == NULL)) {
+      return NULL;
+    }
+    if (!__sync_bool_compare_and_swap(&table->chunk, NULL, chunk)) {
+      free_idx_chunk(chunk, table->log_size);
+      chunk = table->chunk;
+    }
+  }
+  return chunk;
+}
+
+/*
+ * The entry of the chunk may still be on its way out of the slot, so it
+ * is only reused once it has been freed. A claimed entry that gets no
+ * log is freed again.
+ */
+static idx_entry_t *get_chunk_entry(radix_root_t *root, unsigned long epoch,
+                                    void **slot, log_table_t *owner,
+                                    unsigned long bit, log_size_t log_size,
+                                    bool with_log) {
+  idx_entry_t *chunk, *entry, *found;
+
+  chunk = get_leaf_chunk(owner);
+  if (__glibc_unlikely(chunk == NULL)) {
+    return NULL;
+  }
+  entry = &chunk[bit];
+
+  while ((found = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) == NULL) {
+    if (vlock_tryclaim(&entry->lock)) {
+      if (__glibc_unlikely(!alloc_idx_log(entry, log_size, with_log))) {
+        vlock_invalidate(&entry->lock);
+        return NULL;
+      }
+      entry->epoch = epoch;
+      __atomic_store_n(slot, entry, __ATOMIC_RELEASE);
+      mark_dirty_entry(root, owner, bit);
+      return entry;
+    }
+    __builtin_ia32_pause();
+  }
+  return found;
+}
+
+/*
+ * Return the entry in the slot, allocating it if the slot is empty, with
+ * a log block if with_log is set. Return NULL if the pools are exhausted.
+ */
+static inline idx_entry_t *get_slot_entry(radix_root_t *root,
+                                          unsigned long epoch, void **slot,
+                                          log_table_t *owner, unsigned long bit,
+                                          log_size_t log_size, bool with_log) {
   idx_entry_t *entry;
 
-  entry = table->entries[index];
+  entry = *slot;
 
   if (entry == NULL) {
-    entry = alloc_idx_entry(log_size);
+    if (owner->type == TABLE) {
+      return get_chunk_entry(root, epoch, slot, owner, bit, log_size,
+                             with_log);
+    }
+
+    entry = alloc_idx_entry(log_size, with_log);
+    if (__glibc_unlikely(entry == NULL)) {
+      return NULL;
+    }
     entry->epoch = epoch;
 
-    if (!__sync_bool_compare_and_swap(&table->entries[index], NULL, entry)) {
+    if (__sync_bool_compare_and_swap(slot, NULL, entry)) {
+      mark_dirty_entry(root, owner, bit);
+    } else {
       free_idx_entry(entry, log_size);
-      entry = table->entries[index];
+      entry = *slot;
     }
   }
 
   return entry;
 }
+
+/*
+ * Free an entry that has been taken out of its slot in the table.
+ */
+void free_log_entry(log_table_t *table, idx_entry_t *entry,
+                    log_size_t log_size) {
+  if (table->type == TABLE) {
+    free_idx_log(entry, log_size);
+  } else {
+    free_idx_entry(entry, log_size);
+  }
+}
+
+inline idx_entry_t *get_log_entry(radix_root_t *root, unsigned long epoch,
+                                  log_table_t *table, unsigned long index,
+                                  log_size_t log_size) {
+  log_table_t *owner;
+  unsigned long bit;
+  void **slot;
+
+  slot = claim_leaf_slot(table, index, &owner, &bit);
+  if (__glibc_unlikely(slot == NULL)) {
+    return NULL;
+  }
+  return get_slot_entry(root, epoch, slot, owner, bit, log_size, true);
+}
+
+/*
+ * Find the entry of the block at the offset without allocating anything.
+ * NULL means that the block has no log. The log size of the table is
+ * returned in log_size, which is NR_LOG_SIZES if no block of the table
+ * has been written yet.
+ */
+idx_entry_t *find_log_entry(radix_root_t *root, unsigned long offset,
+                            log_size_t *log_size) {
+  log_table_t *table;
+  void **slot;
+
+  table = find_log_table(root, offset);
+  if (table == NULL) {
+    *log_size = NR_LOG_SIZES;
+    return NULL;
+  }
+
+  *log_size = __atomic_load_n(&table->log_size, __ATOMIC_ACQUIRE);
+  if (*log_size == NR_LOG_SIZES) {
+    return NULL;
+  }
+
+  slot = find_leaf_slot(table, TABLE_INDEX(*log_size, offset));
+  return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+}
+
+/*
+ * Range locks over the entries of the leaf tables.
+ *
+ * Every locker takes the entries of its range in the order of their
+ * offsets, so overlapping ranges cannot deadlock. The checkpointer only
+ * tries the locks and leaves busy entries for later. A range is taken
+ * in one pass per leaf table, where the entries of the span are found
+ * by index.
+ */
+
+static inline unsigned long span_end(unsigned long offset,
+                                     unsigned long end) {
+  unsigned long table_end;
+
+  table_end = (offset | ((1UL << LMD_SHIFT) - 1)) + 1;
+  return table_end < end ? table_end : end;
+}
+
+/*
+ * A locked entry may have been freed and reused since it was looked up,
+ * if it is no longer in its slot.
+ */
+static inline bool check_locked_entry(void **slot, idx_entry_t *entry) {
+  if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) == entry) {
+    return true;
+  }
+  vlock_unlock(&entry->lock);
+  return false;
+}
+
+/*
+ * Write-lock the entries of the range and link them in entries_head,
+ * allocating the missing ones. Unless with_log is false, as for appends
+ * written in place, every entry gets a log block. If the pools are
+ * exhausted, unlock the entries taken so far and return false; the
+ * caller has to let the epoch go on before it waits for free logs.
+ */
+bool wrlock_log_range(radix_root_t *root, unsigned long epoch,
+                      unsigned long offset, unsigned long len,
+                      struct slist_head *entries_head, bool with_log) {
+  log_table_t *table, *owner;
+  idx_entry_t *entry;
+  log_size_t log_size;
+  struct slist_head *tail = entries_head;
+  unsigned long index, last, next, bit, end = offset + len;
+  void **slot;
+  int spins;
+
+  while (offset < end) {
+    table = get_log_table(root, offset);
+    if (__glibc_unlikely(table == NULL)) {
+      goto out_of_logs;
+    }
+    log_size = get_log_size(table, offset, end - offset);
+    next = span_end(offset, end);
+    index = TABLE_INDEX(log_size, offset);
+    last = TABLE_INDEX(log_size, next - 1);
+    PRINT("TABLE index=%lu..%lu, log_size=%lu", index, last,
+          LOG_SIZE(log_size));
+
+    for (; index <= last; index++) {
+      slot = claim_leaf_slot(table, index, &owner, &bit);
+      if (__glibc_unlikely(slot == NULL)) {
+        goto out_of_logs;
+      }
+
+      for (spins = 0;; spins++) {
+        entry = get_slot_entry(root, epoch, slot, owner, bit, log_size,
+                               with_log);
+        if (__glibc_unlikely(entry == NULL)) {
+          goto out_of_logs;
+        }
+        if (vlock_trywrlock(&entry->lock)) {
+          if (check_locked_entry(slot, entry)) {
+            break;
+          }
+          continue;
+        }
+        vlock_wait_wr(&entry->lock, spins);
+      }
+
+      entry->log_size = log_size;
+      slist_push(&entry->list, tail);
+      tail = &entry->list;
+
+      /* An entry left by an append gets its log once it is logged. */
+      if (with_log && entry->log == NULL &&
+          __glibc_unlikely(!attach_idx_log(entry, log_size))) {
+        goto out_of_logs;
+      }
+    }
+    offset = next;
+  }
+  return true;
+
+out_of_logs:
+  wrunlock_log_range(entries_head);
+  entries_head->next = NULL;
+  return false;
+}
+
+/*
+ * Read-lock the entries found in the range and store them in entries,
+ * which has room for max_log_blocks(offset, len) of them. Readers share
+ * entries, so they cannot be linked through the entries like writers.
+ * Nothing is allocated for blocks without an entry, since they have no
+ * log to be read. Return the number of entries locked.
+ */
+unsigned long rdlock_log_range(radix_root_t *root, unsigned long offset,
+                               unsigned long len, idx_entry_t **entries) {
+  log_table_t *table;
+  idx_entry_t *entry;
+  log_size_t log_size;
+  unsigned long index, last, next, end = offset + len, nr = 0;
+  void **slot;
+  int spins;
+
+  while (offset < end) {
+    table = find_log_table(root, offset);
+    log_size = table ? __atomic_load_n(&table->log_size, __ATOMIC_ACQUIRE)
+                     : NR_LOG_SIZES;
+
+    next = span_end(offset, end);
+
+    if (log_size == NR_LOG_SIZES) {
+      offset = next;
+      continue;
+    }
+
+    index = TABLE_INDEX(log_size, offset);
+    last = TABLE_INDEX(log_size, next - 1);
+
+    for (; index <= last; index++) {
+      slot = find_leaf_slot(table, index);
+      if (slot == NULL) {
+        continue;
+      }
+
+      for (spins = 0;; spins++) {
+        entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (entry == NULL) {
+          break;
+        }
+        if (vlock_tryrdlock(&entry->lock)) {
+          if (check_locked_entry(slot, entry)) {
+            entries[nr++] = entry;
+            break;
+          }
+          continue;
+        }
+        vlock_wait_rd(&entry->lock, spins);
+      }
+    }
+    offset = next;
+  }
+  return nr;
+}
+
+void rdunlock_log_range(idx_entry_t **entries, unsigned long nr) {
+  unsigned long i;
+
+  for (i = 0; i < nr; i++) {
+    vlock_unlock(&entries[i]->lock);
+  }
+}
+
+/*
+ * The next entry is taken before the current one is unlocked, since
+ * another writer may link it in its own range right away.
+ */
+void wrunlock_log_range(struct slist_head *entries_head) {
+  struct slist_head *node, *next;
+
+  for (node = entries_head->next; node != NULL; node = next) {
+    next = node->next;
+    vlock_unlock(&SLIST_ENTRY(node, idx_entry_t, list)->lock);
+    PRINT("unlock idx_entry");
+  }
+}
@@ -3,8 +3,10 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "config.h"
+#include "lock.h"
 #include "slist.h"
 
 #define PTRS_PER_TABLE (1UL << 9)
@@ -20,59 +22,176 @@
 #define LOG_OFFSET(addr, s) (addr & (LOG_SIZE(s) - 1))
 #define NR_ENTRIES(s) (1UL << (LMD_SHIFT - LOG_SHIFT(s)))
 
-#define TABLE_MASK ((1UL << 27) - 1)
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define DIRTY_MAP_LEN (PTRS_PER_TABLE / BITS_PER_LONG)
+#define SPARSE_SLOTS (32)
 
-typedef enum table_type_enum { TABLE = 1, LMD, LUD, LGD } table_type_t;
+#define EPOCH_BITS (20)
+#define EPOCH_MASK ((1UL << EPOCH_BITS) - 1)
 
+typedef enum table_type_enum {
+  SPARSE_TABLE = 0, /* a leaf table, never a level of the tree itself */
+  TABLE,
+  LMD,
+  LUD,
+  LGD
+} table_type_t;
+
+/*
+ * What recovery needs to know about a log entry, kept in the index pool
+ * in pmem. An entry and its record sit at the same position of the index
+ * arena and the index pool of their node.
+ */
+typedef struct index_record_struct {
+  union {
+    struct {
+      unsigned long united;
+    };
+    struct {
+      unsigned long epoch : EPOCH_BITS;
+      unsigned long offset : 21;
+      unsigned long len : 22;
+      unsigned long policy : 1;
+    };
+  };
+  unsigned long dst;     /* file offset of the logged block */
+  unsigned long log_off; /* offset of the log block in its log file */
+  int mmio_id;           /* slot of the owner in the mmio pool */
+  unsigned short log_size;
+  short log_node; /* NUMA node of the log pool */
+} idx_record_t;
+
+/*
+ * A log entry, in DRAM. The fields it shares with its record are written
+ * to the record when they have to be persisted.
+ */
 typedef struct index_entry_struct {
   union {
     struct {
       unsigned long united;
     };
     struct {
-      unsigned long epoch : 20;
+      unsigned long epoch : EPOCH_BITS;
       unsigned long offset : 21;
       unsigned long len : 22;
       unsigned long policy : 1;
     };
   };
   void *log;
-  void *dst;
-  pthread_rwlock_t *rwlockp;
-  log_size_t log_size;
+  unsigned long dst;
+  idx_record_t *record;
+  vlock_t lock;
   struct slist_head list;
+  log_size_t log_size;
+  int mmio_id;
+  int log_node;
 } idx_entry_t;
 
 typedef struct table_struct {
   log_size_t log_size;
   table_type_t type;
   int index;
-  void *entries[PTRS_PER_TABLE];
+  int dirty; /* linked in the dirty list of the root */
+  struct table_struct *dirty_next;
+  union {
+    struct {
+      unsigned long dirty_map[DIRTY_MAP_LEN]; /* entries that may be logged */
+      void *entries[PTRS_PER_TABLE];
+      idx_entry_t *chunk; /* the entries of a full leaf, one per index */
+    };
+
+    /*
+     * A sparse leaf keeps the entries of up to SPARSE_SLOTS indexes, and
+     * those of the indexes that do not fit in a full overflow table. A
+     * tag is the index of its slot plus one, and 0 if the slot is free.
+     * Its dirty map is only the first word, whose bits are the slots.
+     */
+    struct {
+      unsigned long dirty_map; /* dirty_map[0] */
+      struct table_struct *overflow;
+      unsigned short tags[SPARSE_SLOTS];
+      void *slots[SPARSE_SLOTS];
+    } sparse;
+  };
 } log_table_t;
 
+#define SPARSE_TABLE_SIZE \
+  (offsetof(log_table_t, sparse) + sizeof(((log_table_t *)0)->sparse))
+
 typedef struct radix_root_struct {
   log_table_t *lgd;
   log_table_t *skip;
-  log_table_t *prev_table;
-  unsigned long prev_table_index;
+  log_table_t *dirty; /* leaf tables that hold log entries */
+  unsigned long generation; /* bumped when the tables are dropped */
 } radix_root_t;
 
-#define LGD_INDEX(OFFSET) (OFFSET >> LGD_SHIFT) & (PTRS_PER_TABLE - 1)
-#define LUD_INDEX(OFFSET) (OFFSET >> LUD_SHIFT) & (PTRS_PER_TABLE - 1)
-#define LMD_INDEX(OFFSET) (OFFSET >> LMD_SHIFT) & (PTRS_PER_TABLE - 1)
+#define LGD_INDEX(OFFSET) (((OFFSET) >> LGD_SHIFT) & (PTRS_PER_TABLE - 1))
+#define LUD_INDEX(OFFSET) (((OFFSET) >> LUD_SHIFT) & (PTRS_PER_TABLE - 1))
+#define LMD_INDEX(OFFSET) (((OFFSET) >> LMD_SHIFT) & (PTRS_PER_TABLE - 1))
 #define TABLE_INDEX(LOGSIZE, OFFSET) \
-  (OFFSET >> LOG_SHIFT(LOGSIZE)) & (NR_ENTRIES(LOGSIZE) - 1)
+  (((OFFSET) >> LOG_SHIFT(LOGSIZE)) & (NR_ENTRIES(LOGSIZE) - 1))
 
 #define NEXT_TABLE_TYPE(TYPE) (TYPE - 1)
 
+/*
+ * Length of the rest of the block at the offset. A table without a log
+ * size yet has no entries, so it is skipped as a whole.
+ */
+static inline unsigned long block_len(unsigned long offset,
+                                      log_size_t log_size) {
+  if (log_size == NR_LOG_SIZES) {
+    return (1UL << LMD_SHIFT) - (offset & ((1UL << LMD_SHIFT) - 1));
+  }
+  return LOG_SIZE(log_size) - (offset & (LOG_SIZE(log_size) - 1));
+}
+
+/*
+ * The most blocks the range can span, with the smallest log size.
+ */
+static inline unsigned long max_log_blocks(unsigned long offset,
+                                           unsigned long len) {
+  return ((offset + len - 1) >> PAGE_SHIFT) - (offset >> PAGE_SHIFT) + 1;
+}
+
+/*
+ * The number of words in the dirty map of the table, and the slot of
+ * the entry behind a bit of it.
+ */
+static inline unsigned long dirty_map_len(log_table_t *table) {
+  return table->type == SPARSE_TABLE ? 1 : DIRTY_MAP_LEN;
+}
+
+static inline void **get_dirty_slot(log_table_t *table, unsigned long bit) {
+  if (table->type == SPARSE_TABLE) {
+    return &table->sparse.slots[bit];
+  }
+  return &table->entries[bit];
+}
+
 table_type_t get_deepest_table_type(unsigned long filesize);
 void init_radixlog(radix_root_t *root, unsigned long filesize);
+void release_radixlog(radix_root_t *root);
+void grow_radixlog(radix_root_t *root, unsigned long maxoff);
 log_table_t *get_log_table(radix_root_t *root, unsigned long offset);
 log_table_t *find_log_table(radix_root_t *root, unsigned long offset);
 log_size_t set_log_size(unsigned long offset, size_t len);
 log_size_t get_log_size(log_table_t *table, unsigned long offset, size_t len);
-idx_entry_t *get_log_entry(unsigned long epoch, log_table_t *table,
-                           unsigned long index, log_size_t log_size);
-bool check_prev_table(unsigned long prev_table_index, unsigned long offset);
+idx_entry_t *get_log_entry(radix_root_t *root, unsigned long epoch,
+                           log_table_t *table, unsigned long index,
+                           log_size_t log_size);
+idx_entry_t *find_log_entry(radix_root_t *root, unsigned long offset,
+                            log_size_t *log_size);
+void free_log_entry(log_table_t *table, idx_entry_t *entry,
+                    log_size_t log_size);
+bool wrlock_log_range(radix_root_t *root, unsigned long epoch,
+                      unsigned long offset, unsigned long len,
+                      struct slist_head *entries_head, bool with_log);
+void wrunlock_log_range(struct slist_head *entries_head);
+unsigned long rdlock_log_range(radix_root_t *root, unsigned long offset,
+                               unsigned long len, idx_entry_t **entries);
+void rdunlock_log_range(idx_entry_t **entries, unsigned long nr);
+void push_dirty_table(radix_root_t *root, log_table_t *table);
+log_table_t *pop_dirty_tables(radix_root_t *root);
+void clear_dirty_entry(log_table_t *table, unsigned long index);
 
 #endif /* LIBNVMMIO_LOG_H */
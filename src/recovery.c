@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include "recovery.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "config.h"
+#include "debug.h"
+#include "file.h"
+#include "mmio.h"
+#include "radixlog.h"
+#include "tx.h"
+
+/*
+ * Libnvmmio keeps its logs in a per-process directory (DIR_PATH).
+ * If a process crashes, the directory is left behind. At load time,
+ * recover_logs() finds such orphaned directories and brings the data
+ * files back to their last committed state:
+ *
+ *   - UNDO entries of the uncommitted epoch are rolled back.
+ *   - REDO entries of committed epochs are replayed.
+ *   - Everything else is discarded.
+ *
+ * Recovery reads only the records that the index and mmio pools keep
+ * in pmem for the log entries and mmios of the process. The records
+ * only hold position-independent references (the slot of the owner
+ * mmio, the file offset, and the offset in the log pool), so the pools
+ * can be mapped at any address. A log pool is made of
+ * LOG_SEGMENT_SIZE segment files, mapped one by one. The index pool is split
+ * among NR_RECOVERY_THREADS workers, which bounds the recovery time by
+ * the size of the pool rather than the amount of logged data.
+ *
+ * A multi-file transaction advances the epochs of its mmios one by one
+ * after its tx record reaches the committing state, so the epochs of
+ * the mmios named by a committing record are advanced here before any
+ * entry is looked at.
+ *
+ * With a pmem path per NUMA node, each node has its own log directory
+ * with its index and log pools. The mmio pool is found in the directory
+ * of node 0, and a log entry names the node of its log.
+ */
+
+extern struct fops_struct posix;
+
+typedef struct recovery_file_struct {
+  void *addr;
+  size_t len;
+  int fd;
+} recovery_file_t;
+
+typedef struct recovery_struct {
+  mmio_record_t *mmios;
+  unsigned long *epochs; /* the committed epochs of the mmios */
+  unsigned long nr_mmios;
+  idx_record_t *entries;
+  unsigned long nr_entries;
+  int nr_nodes;
+  void **logs[MAX_NUMA_NODES][NR_LOG_SIZES];
+  int nr_segments[MAX_NUMA_NODES][NR_LOG_SIZES];
+  recovery_file_t *files;
+} recovery_t;
+
+typedef struct recovery_worker_struct {
+  pthread_t thread;
+  recovery_t *rec;
+  unsigned long start;
+  unsigned long end;
+  unsigned long applied;
+} recovery_worker_t;
+
+static void *map_logfile(const char *logdir, char *name, int number,
+                         size_t *len) {
+  char filename[PATH_MAX << 1];
+  struct stat statbuf;
+  void *addr;
+  int fd, s;
+
+  sprintf(filename, LOGFILE_PATH, logdir, name, number);
+
+  fd = posix.open(filename, O_RDONLY);
+  if (fd == -1) {
+    PRINT("no log file: %s", filename);
+    return NULL;
+  }
+
+  s = posix.__fxstat(_STAT_VER, fd, &statbuf);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("fstat(%s)", filename);
+  }
+
+  *len = statbuf.st_size;
+  if (*len == 0) {
+    posix.close(fd);
+    return NULL;
+  }
+
+  addr = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+  if (__glibc_unlikely(addr == MAP_FAILED)) {
+    HANDLE_ERROR("mmap(%s)", filename);
+  }
+  posix.close(fd);
+
+  return addr;
+}
+
+static void open_file(recovery_file_t *file, mmio_record_t *mmio) {
+  struct stat statbuf;
+  int fd, s;
+
+  file->addr = NULL;
+
+  if (mmio->ino == 0 || mmio->path[0] == '\0' ||
+      strnlen(mmio->path, PATH_MAX) == PATH_MAX) {
+    return;
+  }
+
+  fd = posix.open(mmio->path, O_RDWR);
+  if (fd == -1) {
+    PRINT("cannot open %s", mmio->path);
+    return;
+  }
+
+  s = posix.__fxstat(_STAT_VER, fd, &statbuf);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("fstat(%s)", mmio->path);
+  }
+
+  /* The file was replaced after the crash. */
+  if (statbuf.st_ino != mmio->ino || statbuf.st_size == 0) {
+    posix.close(fd);
+    return;
+  }
+
+  file->len = statbuf.st_size;
+  file->addr =
+      mmap(NULL, file->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (__glibc_unlikely(file->addr == MAP_FAILED)) {
+    HANDLE_ERROR("mmap(%s)", mmio->path);
+  }
+  file->fd = fd;
+  PRINT("recovering %s", mmio->path);
+}
+
+static void close_file(recovery_file_t *file, mmio_record_t *mmio,
+                       unsigned long epoch) {
+  off_t fsize;
+  int s;
+
+  if (file->addr == NULL) {
+    return;
+  }
+
+  s = munmap(file->addr, file->len);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("munmap");
+  }
+
+  /*
+   * Drop the preallocated space and the data appended
+   * in the uncommitted epoch.
+   */
+  fsize = mmio->commit_fsize[epoch & 1];
+  if (fsize >= 0 && (size_t)fsize <= file->len) {
+    s = posix.ftruncate(file->fd, fsize);
+    if (__glibc_unlikely(s != 0)) {
+      HANDLE_ERROR("ftruncate(%s)", mmio->path);
+    }
+  }
+
+  s = posix.fsync(file->fd);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("fsync(%s)", mmio->path);
+  }
+  posix.close(file->fd);
+}
+
+static bool recover_entry(recovery_t *rec, idx_record_t *entry) {
+  recovery_file_t *file;
+  log_size_t log_size;
+  void *dst, *src;
+  void **logs;
+  unsigned long seg;
+  bool committed;
+
+  if (entry->len == 0) {
+    return false;
+  }
+
+  if (entry->mmio_id < 0 || (unsigned long)entry->mmio_id >= rec->nr_mmios ||
+      entry->log_size >= NR_LOG_SIZES || entry->log_node < 0 ||
+      entry->log_node >= rec->nr_nodes) {
+    return false;
+  }
+
+  file = &rec->files[entry->mmio_id];
+  log_size = entry->log_size;
+
+  logs = rec->logs[entry->log_node][log_size];
+  seg = entry->log_off / LOG_SEGMENT_SIZE;
+  if (file->addr == NULL ||
+      seg >= (unsigned long)rec->nr_segments[entry->log_node][log_size] ||
+      logs[seg] == NULL) {
+    return false;
+  }
+
+  committed = entry->epoch != (rec->epochs[entry->mmio_id] & EPOCH_MASK);
+
+  switch (entry->policy) {
+    case UNDO:
+      /* Roll back the in-place updates of the uncommitted epoch. */
+      if (committed) {
+        return false;
+      }
+      break;
+    case REDO:
+      /* Replay the committed updates not yet checkpointed. */
+      if (!committed) {
+        return false;
+      }
+      break;
+  }
+
+  if ((unsigned long)entry->offset + entry->len > LOG_SIZE(log_size) ||
+      (entry->log_off % LOG_SEGMENT_SIZE) + LOG_SIZE(log_size) >
+          LOG_SEGMENT_SIZE ||
+      entry->dst + entry->offset + entry->len > file->len) {
+    PRINT("broken idx_record: dst=%lu, log_off=%lu", entry->dst,
+          entry->log_off);
+    return false;
+  }
+
+  dst = file->addr + entry->dst + entry->offset;
+  src = logs[seg] + (entry->log_off % LOG_SEGMENT_SIZE) + entry->offset;
+  NTSTORE(dst, src, entry->len);
+  return true;
+}
+
+static void *recovery_thread_func(void *parm) {
+  recovery_worker_t *worker;
+  unsigned long i;
+
+  worker = (recovery_worker_t *)parm;
+
+  for (i = worker->start; i < worker->end; i++) {
+    if (recover_entry(worker->rec, &worker->rec->entries[i])) {
+      worker->applied++;
+    }
+  }
+  FENCE();
+
+  return NULL;
+}
+
+static void recover_entries(recovery_t *rec) {
+  recovery_worker_t workers[NR_RECOVERY_THREADS];
+  unsigned long chunk, applied = 0;
+  int i, s;
+
+  chunk = (rec->nr_entries + NR_RECOVERY_THREADS - 1) / NR_RECOVERY_THREADS;
+
+  for (i = 0; i < NR_RECOVERY_THREADS; i++) {
+    workers[i].rec = rec;
+    workers[i].start = i * chunk;
+    workers[i].end = workers[i].start + chunk;
+    workers[i].applied = 0;
+
+    if (workers[i].start > rec->nr_entries) {
+      workers[i].start = rec->nr_entries;
+    }
+    if (workers[i].end > rec->nr_entries) {
+      workers[i].end = rec->nr_entries;
+    }
+
+    s = pthread_create(&workers[i].thread, NULL, recovery_thread_func,
+                       &workers[i]);
+    if (__glibc_unlikely(s != 0)) {
+      HANDLE_ERROR("pthread_create");
+    }
+  }
+
+  for (i = 0; i < NR_RECOVERY_THREADS; i++) {
+    s = pthread_join(workers[i].thread, NULL);
+    if (__glibc_unlikely(s != 0)) {
+      HANDLE_ERROR("pthread_join");
+    }
+    applied += workers[i].applied;
+  }
+  PRINT("applied %lu log entries", applied);
+}
+
+static void map_log_segments(recovery_t *rec, int node, const char *logdir) {
+  char name[NAME_MAX];
+  DIR *dirptr;
+  struct dirent *file;
+  void ***logs;
+  int *nr_segments;
+  size_t len;
+  int i, seg, n;
+
+  dirptr = opendir(logdir);
+  if (dirptr == NULL) {
+    PRINT("no log directory: %s", logdir);
+    return;
+  }
+
+  logs = rec->logs[node];
+  nr_segments = rec->nr_segments[node];
+
+  while ((file = readdir(dirptr)) != NULL) {
+    n = 0;
+    if (sscanf(file->d_name, LOG_SEGMENT_NAME "-%d.log%n", &i, &seg, &n) != 2 ||
+        file->d_name[n] != '\0' || i < 0 || i >= NR_LOG_SIZES || seg < 0) {
+      continue;
+    }
+
+    if (seg >= nr_segments[i]) {
+      logs[i] = (void **)realloc(logs[i], (seg + 1) * sizeof(void *));
+      if (__glibc_unlikely(logs[i] == NULL)) {
+        HANDLE_ERROR("realloc");
+      }
+      memset(logs[i] + nr_segments[i], 0,
+             (seg + 1 - nr_segments[i]) * sizeof(void *));
+      nr_segments[i] = seg + 1;
+    }
+
+    sprintf(name, LOG_SEGMENT_NAME, i);
+    logs[i][seg] = map_logfile(logdir, name, seg, &len);
+
+    /* The segment was being created when the process crashed. */
+    if (logs[i][seg] && len != LOG_SEGMENT_SIZE) {
+      munmap(logs[i][seg], len);
+      logs[i][seg] = NULL;
+    }
+  }
+
+  closedir(dirptr);
+}
+
+static void unmap_log_segments(recovery_t *rec) {
+  int node, i, seg, s;
+
+  for (node = 0; node < rec->nr_nodes; node++) {
+    for (i = 0; i < NR_LOG_SIZES; i++) {
+      for (seg = 0; seg < rec->nr_segments[node][i]; seg++) {
+        if (rec->logs[node][i][seg]) {
+          s = munmap(rec->logs[node][i][seg], LOG_SEGMENT_SIZE);
+          if (__glibc_unlikely(s != 0)) {
+            HANDLE_ERROR("munmap");
+          }
+        }
+      }
+      free(rec->logs[node][i]);
+    }
+  }
+}
+
+/*
+ * Advance the mmios of the transactions that crashed after their commit
+ * point, unless their epochs were persisted already.
+ */
+static void roll_forward_txs(recovery_t *rec, const char *logdir) {
+  tx_record_t *txs, *tx;
+  size_t len;
+  unsigned long i, j;
+  int id, s;
+
+  txs = map_logfile(logdir, "tx", 0, &len);
+  if (txs == NULL) {
+    return;
+  }
+
+  for (i = 0; i < len / sizeof(tx_record_t); i++) {
+    tx = &txs[i];
+    if (tx->state != TX_COMMITTING || tx->nr > TX_MAX_FILES) {
+      continue;
+    }
+
+    for (j = 0; j < tx->nr; j++) {
+      id = tx->mmio_ids[j];
+      if (id < 0 || (unsigned long)id >= rec->nr_mmios) {
+        continue;
+      }
+      if (rec->epochs[id] == tx->epochs[j]) {
+        rec->epochs[id]++;
+        PRINT("rolled %s forward to epoch %lu", rec->mmios[id].path,
+              rec->epochs[id]);
+      }
+    }
+  }
+
+  s = munmap(txs, len);
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("munmap");
+  }
+}
+
+static void recover_logdir(char logdirs[][PATH_MAX], int nr_nodes) {
+  recovery_t rec;
+  size_t len;
+  unsigned long i;
+  int node, s;
+
+  memset(&rec, 0, sizeof(recovery_t));
+  rec.nr_nodes = nr_nodes;
+
+  rec.mmios = map_logfile(logdirs[0], "mmio", 0, &len);
+  rec.nr_mmios = len / sizeof(mmio_record_t);
+
+  if (rec.mmios == NULL) {
+    PRINT("nothing to recover in %s", logdirs[0]);
+    return;
+  }
+
+  rec.epochs = (unsigned long *)malloc(rec.nr_mmios * sizeof(unsigned long));
+  if (__glibc_unlikely(rec.epochs == NULL)) {
+    HANDLE_ERROR("malloc");
+  }
+
+  for (i = 0; i < rec.nr_mmios; i++) {
+    rec.epochs[i] = rec.mmios[i].epoch;
+  }
+  roll_forward_txs(&rec, logdirs[0]);
+
+  for (node = 0; node < nr_nodes; node++) {
+    map_log_segments(&rec, node, logdirs[node]);
+  }
+
+  rec.files = (recovery_file_t *)malloc(rec.nr_mmios * sizeof(recovery_file_t));
+  if (__glibc_unlikely(rec.files == NULL)) {
+    HANDLE_ERROR("malloc");
+  }
+
+  for (i = 0; i < rec.nr_mmios; i++) {
+    open_file(&rec.files[i], &rec.mmios[i]);
+  }
+
+  /*
+   * The entries of a node may refer to the logs of any node,
+   * so all the log pools stay mapped until every index is done.
+   */
+  for (node = 0; node < nr_nodes; node++) {
+    rec.entries = map_logfile(logdirs[node], "index", 0, &len);
+    if (rec.entries == NULL) {
+      continue;
+    }
+    rec.nr_entries = len / sizeof(idx_record_t);
+
+    recover_entries(&rec);
+
+    s = munmap(rec.entries, rec.nr_entries * sizeof(idx_record_t));
+    if (__glibc_unlikely(s != 0)) {
+      HANDLE_ERROR("munmap");
+    }
+  }
+
+  for (i = 0; i < rec.nr_mmios; i++) {
+    close_file(&rec.files[i], &rec.mmios[i], rec.epochs[i]);
+  }
+  free(rec.files);
+  free(rec.epochs);
+
+  unmap_log_segments(&rec);
+
+  s = munmap(rec.mmios, rec.nr_mmios * sizeof(mmio_record_t));
+  if (__glibc_unlikely(s != 0)) {
+    HANDLE_ERROR("munmap");
+  }
+}
+
+/*
+ * A log directory is orphaned if nobody holds its lock. Its owner holds the
+ * lock until it exits, so a recycled pid cannot hide an orphan.
+ */
+static int lock_orphan(const char *logdir) {
+  int fd;
+
+  fd = posix.open(logdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    posix.close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Orphans are looked for under the pmem path of node 0, which holds
+ * the lock of the process. The log directories of the other nodes
+ * are recovered and removed along with it.
+ */
+void recover_logs(char pmem_paths[][PATH_MAX], int nr_nodes,
+                  unsigned long self_pid) {
+  char logdirs[MAX_NUMA_NODES][PATH_MAX];
+  DIR *dirptr;
+  struct dirent *file;
+  unsigned long pid;
+  int fd, n, node;
+
+  dirptr = opendir(pmem_paths[0]);
+  if (dirptr == NULL) {
+    return;
+  }
+
+  while ((file = readdir(dirptr)) != NULL) {
+    if (sscanf(file->d_name, DIR_PREFIX "%lu%n", &pid, &n) != 1 ||
+        file->d_name[n] != '\0' || pid == self_pid) {
+      continue;
+    }
+
+    for (node = 0; node < nr_nodes; node++) {
+      snprintf(logdirs[node], PATH_MAX, DIR_PATH, pmem_paths[node], pid);
+    }
+
+    fd = lock_orphan(logdirs[0]);
+    if (fd == -1) {
+      continue;
+    }
+
+    PRINT("found orphaned logs: %s", logdirs[0]);
+    recover_logdir(logdirs, nr_nodes);
+
+    for (node = nr_nodes - 1; node >= 0; node--) {
+      if (access(logdirs[node], F_OK) == 0) {
+        remove_logdir(logdirs[node]);
+      }
+    }
+    posix.close(fd);
+  }
+
+  closedir(dirptr);
+}
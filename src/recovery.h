@@ -0,0 +1,9 @@
+#ifndef LIBNVMMIO_RECOVERY_H
+#define LIBNVMMIO_RECOVERY_H
+
+#include <limits.h>
+
+void recover_logs(char pmem_paths[][PATH_MAX], int nr_nodes,
+                  unsigned long self_pid);
+
+#endif /* LIBNVMMIO_RECOVERY_H */
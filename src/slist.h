@@ -24,9 +24,15 @@ struct slist_head {
 #define SLIST_NEXT_ENTRY(pos_, member_) \
   SLIST_ENTRY((pos_)->member_.next, typeof(*(pos_)), member_)
 
-#define SLIST_FOR_EACH_ENTRY(pos_, head_, member_)              \
-  for (pos_ = SLIST_FIRST_ENTRY(head_, typeof(*pos_), member_); \
-       &pos_->member_ != NULL; pos_ = SLIST_NEXT_ENTRY(pos_, member_))
+/*
+ * The end of the list is checked on the node pointer itself. The address
+ * of a member can never be NULL, so the compiler may drop such a check.
+ */
+#define SLIST_FOR_EACH_ENTRY(pos_, head_, member_)               \
+  for (struct slist_head *node_ = (head_)->next;                 \
+       node_ != NULL &&                                          \
+       ((pos_ = SLIST_ENTRY(node_, typeof(*pos_), member_)), 1); \
+       node_ = pos_->member_.next)
 
 static inline void slist_push(struct slist_head *new_node,
                               struct slist_head *head) {
@@ -0,0 +1,155 @@
+#include "tx.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "debug.h"
+#include "file.h"
+#include "file_hash.h"
+#include "libnvmmio.h"
+#include "mmio.h"
+
+/*
+ * A multi-file transaction commits the epochs of several mmios at once.
+ * It leads the next commit of each mmio and stops their writers, as the
+ * commit of a single mmio does, and then persists a tx record naming
+ * the mmios and their epochs before it persists any of the new epochs.
+ * The record is the commit point: if the process crashes before every
+ * epoch is persisted, recovery advances the rest from the record.
+ *
+ * A transaction holds the inode numbers of its files, not their mmios,
+ * since a file may be closed before the commit and its mmio reused.
+ * The commit looks the mmios up again and keeps their hash lists locked,
+ * so that no file can be closed until it is over.
+ *
+ * Until then, the committer must not commit the files on its own, or a
+ * crash could find some of them committed and the others not. So each
+ * file is held from nvmmio_tx_add_fd() until the transaction is over,
+ * and its writers are throttled when the logs run short.
+ */
+struct nvmmio_tx_struct {
+  int nr;
+  unsigned long inos[TX_MAX_FILES];
+  unsigned long generations[TX_MAX_FILES]; /* of the held mmios */
+};
+
+nvmmio_tx_t *nvmmio_tx_begin(void) {
+  return (nvmmio_tx_t *)calloc(1, sizeof(nvmmio_tx_t));
+}
+
+int nvmmio_tx_add_fd(nvmmio_tx_t *tx, int fd) {
+  unsigned long ino;
+  int i;
+
+  ino = get_atomic_ino(fd);
+  if (ino == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Another fd of the same file. */
+  for (i = 0; i < tx->nr; i++) {
+    if (tx->inos[i] == ino) {
+      return 0;
+    }
+  }
+
+  if (tx->nr == TX_MAX_FILES) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  tx->generations[tx->nr] = hold_mmio_hash(ino);
+  if (tx->generations[tx->nr] == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  tx->inos[tx->nr++] = ino;
+  return 0;
+}
+
+static int __tx_commit(nvmmio_tx_t *tx) {
+  mmio_t *mmios[TX_MAX_FILES], *mmio;
+  unsigned long inos[TX_MAX_FILES];
+  tx_record_t *record;
+  int i;
+
+  if (tx->nr == 0) {
+    return 0;
+  }
+
+  /*
+   * The hash lists are locked in order, so transactions sharing files
+   * are serialized before they lead any commit. They are sorted in a
+   * copy, which keeps the generations of the holds in line.
+   */
+  memcpy(inos, tx->inos, tx->nr * sizeof(unsigned long));
+  if (!lock_mmio_hashes(inos, tx->nr, mmios)) {
+    errno = EBADF;
+    return -1;
+  }
+
+  record = alloc_tx_record();
+  if (record == NULL) {
+    unlock_mmio_hashes(inos, tx->nr);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  for (i = 0; i < tx->nr; i++) {
+    lead_commit(mmios[i]);
+  }
+  for (i = 0; i < tx->nr; i++) {
+    quiesce_writers(mmios[i]);
+  }
+
+  for (i = 0; i < tx->nr; i++) {
+    mmio = mmios[i];
+    flush_next_fsize(mmio);
+    record->mmio_ids[i] = mmio->id;
+    record->epochs[i] = mmio->epoch;
+  }
+  record->nr = tx->nr;
+  FLUSH(record, sizeof(tx_record_t));
+  FENCE();
+
+  record->state = TX_COMMITTING;
+  FLUSH(&record->state, sizeof(unsigned long));
+  FENCE();
+  PRINT("commit point of %d files", tx->nr);
+
+  for (i = 0; i < tx->nr; i++) {
+    flush_next_epoch(mmios[i]);
+  }
+  FENCE();
+
+  /*
+   * The record must be free in pmem before it is filled again.
+   */
+  record->state = TX_FREE;
+  FLUSH(&record->state, sizeof(unsigned long));
+  FENCE();
+  free_tx_record(record);
+
+  for (i = 0; i < tx->nr; i++) {
+    publish_epoch(mmios[i]);
+    finish_commit(mmios[i]);
+  }
+
+  unlock_mmio_hashes(inos, tx->nr);
+  return 0;
+}
+
+int nvmmio_tx_commit(nvmmio_tx_t *tx) {
+  int i, ret;
+
+  ret = __tx_commit(tx);
+
+  for (i = 0; i < tx->nr; i++) {
+    unhold_mmio_hash(tx->inos[i], tx->generations[i]);
+  }
+  free(tx);
+  return ret;
+}
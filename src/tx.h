@@ -0,0 +1,21 @@
+#ifndef LIBNVMMIO_TX_H
+#define LIBNVMMIO_TX_H
+
+#include "config.h"
+
+#define TX_FREE (0)
+#define TX_COMMITTING (1)
+
+/*
+ * A transaction in the tx pool in pmem, while the epochs of its mmios
+ * advance. Once the record is committing, recovery takes the epochs of
+ * the mmios that are still at the given epochs as committed.
+ */
+typedef struct tx_record_struct {
+  unsigned long state;
+  unsigned long nr;
+  int mmio_ids[TX_MAX_FILES];
+  unsigned long epochs[TX_MAX_FILES]; /* the epochs being committed */
+} tx_record_t;
+
+#endif /* LIBNVMMIO_TX_H */